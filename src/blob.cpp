@@ -6,4 +6,6 @@
 #include "sys/sysinfo.cpp"
 #include "sys/mutex.cpp"
 #include "sys/condition.cpp"
+#include "sys/futex.cpp"
+#include "sys/fiber.cpp"
 #include "sys/platform.cpp"
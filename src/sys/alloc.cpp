@@ -199,6 +199,18 @@ namespace pf
   }
 
   void alignedFree(void *ptr) { _mm_free(ptr); }
+
+  void releasePages(void *ptr, size_t size) {
+    VirtualAlloc(ptr, size, MEM_RESET, PAGE_READWRITE);
+  }
+
+  // Large pages require a privilege most processes do not have
+  void *mapPages(size_t size, size_t align) { return alignedMalloc(size, align); }
+  void unmapPages(void *ptr, size_t size) { alignedFree(ptr); }
+  // mapPages comes from the heap here. Protecting its pages is not safe
+  void protectPages(void *ptr, size_t size) {}
+  void bindPages(void *ptr, size_t size, int node) {}
+  void adviseHugePages(void *ptr, size_t size) {}
 }
 #endif
 
@@ -212,6 +224,7 @@ namespace pf
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <malloc.h>
+#include <sys/syscall.h>
 #include <iostream>
 
 namespace pf
@@ -224,6 +237,45 @@ namespace pf
   }
 
   void alignedFree(void *ptr) { free(ptr); }
+
+  void releasePages(void *ptr, size_t size) {
+    madvise(ptr, size, MADV_DONTNEED);
+  }
+
+  // We map more than needed and unmap what is outside the aligned range
+  void *mapPages(size_t size, size_t align) {
+    const size_t mapped = size + align;
+    void *ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    FATAL_IF (ptr == MAP_FAILED, "memory allocation failed");
+    char *first = (char *) ptr;
+    char *aligned = (char *) ((uintptr_t(first) + align - 1) & ~(align - 1));
+    char *last = first + mapped;
+    if (aligned != first) munmap(first, aligned - first);
+    if (aligned + size != last) munmap(aligned + size, last - aligned - size);
+    return aligned;
+  }
+
+  void unmapPages(void *ptr, size_t size) { munmap(ptr, size); }
+  void protectPages(void *ptr, size_t size) { mprotect(ptr, size, PROT_NONE); }
+
+  // We call mbind directly to avoid depending on libnuma. The node is only
+  // preferred such that allocations never fail when it is full
+  void bindPages(void *ptr, size_t size, int node) {
+#if defined(__NR_mbind)
+    enum { MPOL_PREFERRED_ = 1, MPOL_MF_MOVE_ = 1 << 1 };
+    const unsigned long maskBits = sizeof(unsigned long) * 8;
+    if (node < 0 || node >= int(maskBits) - 1) return;
+    const unsigned long mask = 1ul << node;
+    syscall(__NR_mbind, ptr, size, MPOL_PREFERRED_, &mask, maskBits, MPOL_MF_MOVE_);
+#endif /* defined(__NR_mbind) */
+  }
+
+  void adviseHugePages(void *ptr, size_t size) {
+#if defined(MADV_HUGEPAGE)
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif /* defined(MADV_HUGEPAGE) */
+  }
 }
 
 #endif
@@ -235,6 +287,7 @@ namespace pf
 #ifdef __MACOSX__
 
 #include <cstdlib>
+#include <sys/mman.h>
 
 namespace pf
 {
@@ -252,6 +305,29 @@ namespace pf
     PF_ASSERT(ptr);
     free(((void**)ptr)[-1]);
   }
+
+  void releasePages(void *ptr, size_t size) {
+    madvise(ptr, size, MADV_FREE);
+  }
+
+  // We map more than needed and unmap what is outside the aligned range
+  void *mapPages(size_t size, size_t align) {
+    const size_t mapped = size + align;
+    void *ptr = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANON, -1, 0);
+    FATAL_IF (ptr == MAP_FAILED, "memory allocation failed");
+    char *first = (char *) ptr;
+    char *aligned = (char *) ((uintptr_t(first) + align - 1) & ~(align - 1));
+    char *last = first + mapped;
+    if (aligned != first) munmap(first, aligned - first);
+    if (aligned + size != last) munmap(aligned + size, last - aligned - size);
+    return aligned;
+  }
+
+  void unmapPages(void *ptr, size_t size) { munmap(ptr, size); }
+  void protectPages(void *ptr, size_t size) { mprotect(ptr, size, PROT_NONE); }
+  void bindPages(void *ptr, size_t size, int node) {}
+  void adviseHugePages(void *ptr, size_t size) {}
 }
 
 #endif
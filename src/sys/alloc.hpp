@@ -35,6 +35,27 @@ namespace pf
   void* alignedMalloc(size_t size, size_t align = 64);
   void  alignedFree(void* ptr);
 
+  /*! Give the physical pages of a page aligned range back to the system. The
+   *  range remains allocated and its content is undefined
+   */
+  void  releasePages(void *ptr, size_t size);
+  /*! Map a range of pages aligned on align (a power of 2) */
+  void* mapPages(size_t size, size_t align);
+  /*! Unmap a range returned by mapPages */
+  void  unmapPages(void *ptr, size_t size);
+  /*! Make a page aligned range of mapPages inaccessible (any access faults).
+   *  Nothing is done if the system cannot do it
+   */
+  void  protectPages(void *ptr, size_t size);
+  /*! Place a page aligned range on the given NUMA node. Pages already touched
+   *  are moved there. Nothing is done if the system cannot do it
+   */
+  void  bindPages(void *ptr, size_t size, int node);
+  /*! Ask transparent huge pages to back a range of mapPages. Nothing is done
+   *  if the system cannot do it
+   */
+  void  adviseHugePages(void *ptr, size_t size);
+
   /*! Monitor memory allocations */
 #if PF_DEBUG_MEMORY
   void* MemDebuggerInsertAlloc(void*, const char*, const char*, int);
@@ -152,7 +173,7 @@ namespace pf
     typedef const value_type& const_reference;
     typedef std::size_t size_type;
     typedef std::ptrdiff_t difference_type;
-    typedef typename std::allocator<void>::const_pointer void_allocator_ptr;
+    typedef const void* void_allocator_ptr;
     template<typename U>
     struct rebind { typedef Allocator<U> other; };
 
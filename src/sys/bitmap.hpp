@@ -0,0 +1,147 @@
+// ======================================================================== //
+// Copyright 2009-2011 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_BITMAP_HPP__
+#define __PF_BITMAP_HPP__
+
+#include "sys/platform.hpp"
+#include "sys/intrinsics.hpp"
+#include "sys/alloc.hpp"
+
+namespace pf
+{
+  /*! Lock-free set of bits with a summary word. The summary has one bit per
+   *  word of the bitmap: when a word has some bits set, its summary bit is
+   *  set. Finding a set bit is therefore basically two bit scans, whatever
+   *  the number of bits (up to bitsPerWord * bitsPerWord)
+   */
+  class CACHE_LINE_ALIGNED Bitmap
+  {
+  public:
+    enum { bitsPerWord = sizeof(atomic_t) * 8 };
+    enum { maxBitNum = bitsPerWord * bitsPerWord };
+
+    /*! All bits are initially cleared */
+    Bitmap(uint32 bitNum) : summary(0), bitNum(bitNum) {
+      FATAL_IF (bitNum > uint32(maxBitNum), "Too many bits for the bitmap");
+      const uint32 wordNum = (bitNum + bitsPerWord - 1) / bitsPerWord;
+      this->words = (volatile atomic_t*) PF_ALIGNED_MALLOC(wordNum * sizeof(atomic_t), CACHE_LINE);
+      for (uint32 i = 0; i < wordNum; ++i) this->words[i] = 0;
+    }
+    ~Bitmap(void) { PF_ALIGNED_FREE((void*) this->words); }
+
+    /*! Number of bits in the bitmap */
+    INLINE uint32 getBitNum(void) const { return this->bitNum; }
+    /*! Number of words in the bitmap (and in the masks of findNext) */
+    INLINE uint32 getWordNum(void) const {
+      return (this->bitNum + bitsPerWord - 1) / bitsPerWord;
+    }
+    /*! True if no bit is set */
+    INLINE bool empty(void) const { return this->summary == 0; }
+    /*! Read the given bit */
+    INLINE bool get(uint32 bit) const {
+      PF_ASSERT(bit < this->bitNum);
+      return (size_t(this->words[bit / bitsPerWord]) & getMask(bit)) != 0;
+    }
+    /*! Atomically set the given bit */
+    INLINE void set(uint32 bit) {
+      PF_ASSERT(bit < this->bitNum);
+      const uint32 wordID = bit / bitsPerWord;
+      atomic_or(&this->words[wordID], atomic_t(getMask(bit)));
+      if ((size_t(this->summary) & getMask(wordID)) == 0)
+        atomic_or(&this->summary, atomic_t(getMask(wordID)));
+    }
+    /*! Atomically clear the given bit. When the word becomes empty, we clear
+     *  its summary bit. Since someone may have set another bit of the word in
+     *  the mean time, we check the word again and set the summary bit back if
+     *  needed
+     */
+    INLINE void clear(uint32 bit) {
+      PF_ASSERT(bit < this->bitNum);
+      const uint32 wordID = bit / bitsPerWord;
+      const size_t mask = getMask(bit);
+      const size_t prev = atomic_and(&this->words[wordID], atomic_t(~mask));
+      if ((prev & ~mask) != 0) return;
+      atomic_and(&this->summary, atomic_t(~getMask(wordID)));
+      if (UNLIKELY(this->words[wordID] != 0))
+        atomic_or(&this->summary, atomic_t(getMask(wordID)));
+    }
+    /*! Return the first set bit at or after "from" (wrapping around at the
+     *  end). Return -1 if there is no set bit
+     */
+    INLINE int32 findNext(uint32 from) const {
+      PF_ASSERT(from < this->bitNum);
+      const uint32 first = from / bitsPerWord;
+      const size_t bits = size_t(this->words[first]) & ~(getMask(from) - 1);
+      if (bits) return int32(first * bitsPerWord + __bsf(bits));
+      const size_t summary = this->summary;
+      const size_t after = summary & (~size_t(1) << first);
+      for (size_t curr = after; curr; curr &= curr - 1) {
+        const int32 found = this->findInWord(uint32(__bsf(curr)));
+        if (found >= 0) return found;
+      }
+      for (size_t curr = summary & ~after; curr; curr &= curr - 1) {
+        const int32 found = this->findInWord(uint32(__bsf(curr)));
+        if (found >= 0) return found;
+      }
+      return -1;
+    }
+    /*! Same as above but only the bits also set in mask (getWordNum() words)
+     *  are considered
+     */
+    INLINE int32 findNext(uint32 from, const size_t *mask) const {
+      PF_ASSERT(from < this->bitNum);
+      const uint32 first = from / bitsPerWord;
+      const size_t bits = size_t(this->words[first]) & mask[first] & ~(getMask(from) - 1);
+      if (bits) return int32(first * bitsPerWord + __bsf(bits));
+      const size_t summary = this->summary;
+      const size_t after = summary & (~size_t(1) << first);
+      for (size_t curr = after; curr; curr &= curr - 1) {
+        const int32 found = this->findInWord(uint32(__bsf(curr)), mask);
+        if (found >= 0) return found;
+      }
+      for (size_t curr = summary & ~after; curr; curr &= curr - 1) {
+        const int32 found = this->findInWord(uint32(__bsf(curr)), mask);
+        if (found >= 0) return found;
+      }
+      return -1;
+    }
+    /*! Return the first set bit or -1 if there is no set bit */
+    INLINE int32 findFirst(void) const { return this->findNext(0); }
+
+  private:
+    static INLINE size_t getMask(uint32 bit) {
+      return size_t(1) << (bit % bitsPerWord);
+    }
+    INLINE int32 findInWord(uint32 wordID) const {
+      const size_t bits = this->words[wordID];
+      return bits ? int32(wordID * bitsPerWord + __bsf(bits)) : -1;
+    }
+    INLINE int32 findInWord(uint32 wordID, const size_t *mask) const {
+      const size_t bits = size_t(this->words[wordID]) & mask[wordID];
+      return bits ? int32(wordID * bitsPerWord + __bsf(bits)) : -1;
+    }
+    volatile atomic_t summary;  //!< One bit per (maybe) non-empty word
+    volatile atomic_t *words;   //!< The bits themselves
+    uint32 bitNum;              //!< Number of bits in the bitmap
+    Bitmap(const Bitmap&);            // don't implement
+    Bitmap& operator= (const Bitmap&);// don't implement
+    PF_ALIGNED_CLASS(CACHE_LINE);
+  };
+}
+
+#endif /* __PF_BITMAP_HPP__ */
+
@@ -59,7 +59,9 @@ namespace pf
     PF_DELETE((Mingw32Cond *)cond);
   }
 
-  void ConditionSys::wait(MutexSys& mutex)
+  void ConditionSys::wait(MutexSys& mutex) { this->wait(mutex, -1); }
+
+  void ConditionSys::wait(MutexSys& mutex, int64 timeoutUs)
   {
     Mingw32Cond *cv = (Mingw32Cond *) cond;
     int result, last_waiter;
@@ -73,7 +75,7 @@ namespace pf
     // It's ok to release the mutex here since Win32 manual-reset events
     // maintain state when used with SetEvent()
     LeaveCriticalSection((CRITICAL_SECTION *) mutex.mutex);
-    timeout_ms = INFINITE;
+    timeout_ms = timeoutUs < 0 ? INFINITE : DWORD((timeoutUs + 999) / 1000);
 
     // Wait for either event to become signaled due to glfwSignalCond or
     // glfwBroadcastCond being called
@@ -119,6 +121,7 @@ namespace pf
   ConditionSys::ConditionSys () { cond = PF_NEW(CONDITION_VARIABLE); InitializeConditionVariable((CONDITION_VARIABLE*)cond); }
   ConditionSys::~ConditionSys() { PF_DELETE((CONDITION_VARIABLE*)cond); }
   void ConditionSys::wait(MutexSys& mutex) { SleepConditionVariableCS((CONDITION_VARIABLE*)cond, (CRITICAL_SECTION*)mutex.mutex, INFINITE); }
+  void ConditionSys::wait(MutexSys& mutex, int64 timeoutUs) { SleepConditionVariableCS((CONDITION_VARIABLE*)cond, (CRITICAL_SECTION*)mutex.mutex, DWORD((timeoutUs + 999) / 1000)); }
   void ConditionSys::broadcast() { WakeAllConditionVariable((CONDITION_VARIABLE*)cond); }
 } /* namespace pf */
 #endif /* __GNUC__ */
@@ -126,11 +129,21 @@ namespace pf
 
 #if defined(__UNIX__)
 #include <pthread.h>
+#include <sys/time.h>
 namespace pf
 {
   ConditionSys::ConditionSys () { cond = PF_NEW(pthread_cond_t); pthread_cond_init((pthread_cond_t*)cond,NULL); }
   ConditionSys::~ConditionSys() { PF_DELETE((pthread_cond_t*)cond); }
   void ConditionSys::wait(MutexSys& mutex) { pthread_cond_wait((pthread_cond_t*)cond, (pthread_mutex_t*)mutex.mutex); }
+  void ConditionSys::wait(MutexSys& mutex, int64 timeoutUs) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    const int64 endUs = int64(now.tv_usec) + timeoutUs;
+    struct timespec end;
+    end.tv_sec = now.tv_sec + time_t(endUs / 1000000);
+    end.tv_nsec = long(endUs % 1000000) * 1000;
+    pthread_cond_timedwait((pthread_cond_t*)cond, (pthread_mutex_t*)mutex.mutex, &end);
+  }
   void ConditionSys::broadcast() { pthread_cond_broadcast((pthread_cond_t*)cond); }
 } /* namespace pf */
 #endif /* __UNIX__ */
@@ -27,6 +27,8 @@ namespace pf
     ConditionSys( void );
     ~ConditionSys( void );
     void wait( class MutexSys& mutex );
+    /*! Wait at most timeoutUs microseconds */
+    void wait( class MutexSys& mutex, int64 timeoutUs );
     void broadcast( void );
 
   protected:
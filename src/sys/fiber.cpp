@@ -0,0 +1,152 @@
+// ======================================================================== //
+// Copyright 2009-2011 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "sys/fiber.hpp"
+#include "sys/alloc.hpp"
+
+#if defined(__WIN32__)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+namespace pf
+{
+  Fiber::Fiber(fiber_func func, void *arg, size_t stackSize) :
+    stack(NULL), stackSize(stackSize)
+  {
+    this->context = CreateFiber(stackSize, (LPFIBER_START_ROUTINE) func, arg);
+    FATAL_IF (this->context == NULL, "Unable to create a fiber");
+  }
+  Fiber::Fiber(void) : stack(NULL), stackSize(0) {
+    this->context = ConvertThreadToFiber(NULL);
+    FATAL_IF (this->context == NULL, "Unable to convert the thread to a fiber");
+  }
+  Fiber::~Fiber(void) {
+    if (this->stackSize) DeleteFiber(this->context);
+    else ConvertFiberToThread();
+  }
+  void Fiber::switchTo(Fiber &to) { SwitchToFiber(to.context); }
+} /* namespace pf */
+
+#else
+
+// The switch only saves the callee-saved registers (the caller already
+// spilled everything else). MXCSR and the x87 control word are not saved:
+// all the threads of the tasking system share the same settings
+#if defined(__MACOSX__)
+#define PF_FIBER_SYM(X) "_" #X
+#define PF_FIBER_TYPE(X)
+#else
+#define PF_FIBER_SYM(X) #X
+#define PF_FIBER_TYPE(X) ".type " #X ", @function\n"
+#endif /* defined(__MACOSX__) */
+
+extern "C" void pf_fiber_switch(void **from, void *to);
+extern "C" void pf_fiber_trampoline(void);
+
+#if defined(__X86_64__)
+asm(".text\n"
+    ".globl " PF_FIBER_SYM(pf_fiber_switch) "\n"
+    PF_FIBER_TYPE(pf_fiber_switch)
+    PF_FIBER_SYM(pf_fiber_switch) ":\n"
+    "  pushq %rbp\n"
+    "  pushq %rbx\n"
+    "  pushq %r12\n"
+    "  pushq %r13\n"
+    "  pushq %r14\n"
+    "  pushq %r15\n"
+    "  movq %rsp, (%rdi)\n"
+    "  movq %rsi, %rsp\n"
+    "  popq %r15\n"
+    "  popq %r14\n"
+    "  popq %r13\n"
+    "  popq %r12\n"
+    "  popq %rbx\n"
+    "  popq %rbp\n"
+    "  ret\n"
+    ".globl " PF_FIBER_SYM(pf_fiber_trampoline) "\n"
+    PF_FIBER_TYPE(pf_fiber_trampoline)
+    PF_FIBER_SYM(pf_fiber_trampoline) ":\n"
+    "  movq %rbx, %rdi\n"
+    "  andq $-16, %rsp\n"
+    "  call *%r12\n"
+    "  ud2\n");
+#else
+asm(".text\n"
+    ".globl " PF_FIBER_SYM(pf_fiber_switch) "\n"
+    PF_FIBER_TYPE(pf_fiber_switch)
+    PF_FIBER_SYM(pf_fiber_switch) ":\n"
+    "  movl 4(%esp), %eax\n"
+    "  movl 8(%esp), %edx\n"
+    "  pushl %ebp\n"
+    "  pushl %ebx\n"
+    "  pushl %esi\n"
+    "  pushl %edi\n"
+    "  movl %esp, (%eax)\n"
+    "  movl %edx, %esp\n"
+    "  popl %edi\n"
+    "  popl %esi\n"
+    "  popl %ebx\n"
+    "  popl %ebp\n"
+    "  ret\n"
+    ".globl " PF_FIBER_SYM(pf_fiber_trampoline) "\n"
+    PF_FIBER_TYPE(pf_fiber_trampoline)
+    PF_FIBER_SYM(pf_fiber_trampoline) ":\n"
+    "  andl $-16, %esp\n"
+    "  subl $12, %esp\n"
+    "  pushl %ebx\n"
+    "  call *%esi\n"
+    "  ud2\n");
+#endif /* defined(__X86_64__) */
+
+namespace pf
+{
+  // The stack grows down to a guard page. An overflow (deeply nested tasks run
+  // while waiting for example) faults instead of corrupting the memory below
+  Fiber::Fiber(fiber_func func, void *arg, size_t stackSize) :
+    stackSize(((stackSize + PAGE_BYTES - 1) & ~size_t(PAGE_BYTES - 1)) + PAGE_BYTES)
+  {
+    this->stack = mapPages(this->stackSize, PAGE_BYTES);
+    protectPages(this->stack, PAGE_BYTES);
+    // Build the frame that pf_fiber_switch will pop: the callee-saved
+    // registers and the return address of the trampoline that calls func
+    void **top = (void**) ((uintptr_t) this->stack + this->stackSize);
+    *--top = NULL; // fake return address of the trampoline
+    *--top = (void*) &pf_fiber_trampoline;
+#if defined(__X86_64__)
+    *--top = NULL;          // rbp
+    *--top = arg;           // rbx
+    *--top = (void*) func;  // r12
+    *--top = NULL;          // r13
+    *--top = NULL;          // r14
+    *--top = NULL;          // r15
+#else
+    *--top = NULL;          // ebp
+    *--top = arg;           // ebx
+    *--top = (void*) func;  // esi
+    *--top = NULL;          // edi
+#endif /* defined(__X86_64__) */
+    this->context = top;
+  }
+  Fiber::Fiber(void) : context(NULL), stack(NULL), stackSize(0) {}
+  Fiber::~Fiber(void) { if (this->stack) unmapPages(this->stack, this->stackSize); }
+  void Fiber::switchTo(Fiber &to) { pf_fiber_switch(&this->context, to.context); }
+} /* namespace pf */
+
+#undef PF_FIBER_SYM
+#undef PF_FIBER_TYPE
+
+#endif /* defined(__WIN32__) */
+
@@ -0,0 +1,54 @@
+// ======================================================================== //
+// Copyright 2009-2011 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_FIBER_HPP__
+#define __PF_FIBER_HPP__
+
+#include "sys/platform.hpp"
+
+namespace pf
+{
+  /*! Entry point of a fiber. It must never return */
+  typedef void (*fiber_func)(void*);
+
+  /*! A fiber is a user-mode execution context with its own stack. Switching
+   *  from one fiber to another only saves and restores the callee-saved
+   *  registers: there is no kernel involvement at all. A fiber may be resumed
+   *  by any thread (and may therefore migrate from one thread to another)
+   */
+  class Fiber
+  {
+  public:
+    /*! Create a new fiber that will start in func(arg) on its own stack */
+    Fiber(fiber_func func, void *arg, size_t stackSize);
+    /*! Wrap the calling thread into a fiber (no stack is allocated). The
+     *  thread itself must destroy it
+     */
+    Fiber(void);
+    ~Fiber(void);
+    /*! Save the current context in this and jump into "to" */
+    void switchTo(Fiber &to);
+  private:
+    void *context;    //!< Saved stack pointer (or native fiber handle)
+    void *stack;      //!< Allocated stack (NULL for thread fibers)
+    size_t stackSize; //!< Its size in bytes (with the guard page if any)
+    Fiber(const Fiber&); // don't implement
+    Fiber& operator= (const Fiber&); // don't implement
+  };
+}
+
+#endif /* __PF_FIBER_HPP__ */
+
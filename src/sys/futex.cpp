@@ -0,0 +1,65 @@
+// ======================================================================== //
+// Copyright 2009-2011 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "sys/futex.hpp"
+
+#if defined(__LINUX__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#include <ctime>
+
+namespace pf
+{
+  /*! Process private futexes are enough (and faster) for us */
+  FutexSys::FutexSys(void) {}
+  FutexSys::~FutexSys(void) {}
+  void FutexSys::wait(volatile int32 *addr, int32 expected, int64 timeoutUs) {
+    struct timespec timeout, *pTimeout = NULL;
+    if (timeoutUs >= 0) {
+      timeout.tv_sec = time_t(timeoutUs / 1000000);
+      timeout.tv_nsec = long(timeoutUs % 1000000) * 1000;
+      pTimeout = &timeout;
+    }
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, pTimeout, NULL, 0);
+  }
+  void FutexSys::wakeUp(volatile int32 *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  }
+} /* namespace pf */
+
+#else
+
+namespace pf
+{
+  FutexSys::FutexSys(void) {}
+  FutexSys::~FutexSys(void) {}
+  void FutexSys::wait(volatile int32 *addr, int32 expected, int64 timeoutUs) {
+    Lock<MutexSys> lock(mutex);
+    if (timeoutUs >= 0) {
+      if (*addr == expected) cond.wait(mutex, timeoutUs);
+    } else
+      while (*addr == expected) cond.wait(mutex);
+  }
+  void FutexSys::wakeUp(volatile int32 *addr) {
+    Lock<MutexSys> lock(mutex);
+    cond.broadcast();
+  }
+} /* namespace pf */
+
+#endif /* defined(__LINUX__) */
+
@@ -0,0 +1,55 @@
+// ======================================================================== //
+// Copyright 2009-2011 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_FUTEX_HPP__
+#define __PF_FUTEX_HPP__
+
+#include "sys/platform.hpp"
+#if !defined(__LINUX__)
+#include "sys/mutex.hpp"
+#include "sys/condition.hpp"
+#endif /* !defined(__LINUX__) */
+
+namespace pf
+{
+  /*! Park threads on a 32 bits word. This is a futex on Linux: waiting and
+   *  waking up only go to the kernel when really needed. Elsewhere, we
+   *  emulate it with a mutex and a condition variable. As usual, the waker
+   *  first modifies the word and then wakes the waiters up
+   */
+  class FutexSys
+  {
+  public:
+    FutexSys(void);
+    ~FutexSys(void);
+    /*! Sleep while *addr == expected (at most timeoutUs microseconds if not
+     *  negative). Spurious wake ups may happen
+     */
+    void wait(volatile int32 *addr, int32 expected, int64 timeoutUs = -1);
+    /*! Wake up all the threads waiting on addr */
+    void wakeUp(volatile int32 *addr);
+  private:
+#if !defined(__LINUX__)
+    MutexSys mutex;   //!< Protects the condition variable
+    ConditionSys cond;//!< Waiters sleep on it
+#endif /* !defined(__LINUX__) */
+    FutexSys(const FutexSys&); // don't implement
+    FutexSys& operator= (const FutexSys&); // don't implement
+  };
+}
+
+#endif /* __PF_FUTEX_HPP__ */
+
@@ -91,6 +91,14 @@ INLINE int32 atomic_cmpxchg(volatile int32* m, const int32 v, const int32 c) {
   return _InterlockedCompareExchange((volatile long*)m,v,c);
 }
 
+INLINE int32 atomic_or(volatile int32* m, const int32 v) {
+  return _InterlockedOr((volatile long*)m,v);
+}
+
+INLINE int32 atomic_and(volatile int32* m, const int32 v) {
+  return _InterlockedAnd((volatile long*)m,v);
+}
+
 #if defined(__X86_64__)
 
 typedef int64 atomic_t;
@@ -103,10 +111,22 @@ INLINE int64 atomic_cmpxchg(volatile int64* m, const int64 v, const int64 c) {
   return _InterlockedCompareExchange64(m,v,c);
 }
 
+INLINE int64 atomic_or(volatile int64* m, const int64 v) {
+  return _InterlockedOr64(m,v);
+}
+
+INLINE int64 atomic_and(volatile int64* m, const int64 v) {
+  return _InterlockedAnd64(m,v);
+}
+
 #else
 
 typedef int32 atomic_t;
 
+INLINE int64 atomic_cmpxchg(volatile int64* m, const int64 v, const int64 c) {
+  return _InterlockedCompareExchange64(m,v,c);
+}
+
 #endif /* defined(__X86_64__) */
 
 #else
@@ -165,6 +185,12 @@ INLINE int32 atomic_add(int32 volatile* value, int32 input)
 INLINE int32 atomic_cmpxchg(int32 volatile* value, const int32 input, int32 comparand)
 {  asm volatile("lock cmpxchg %2,%0" : "=m" (*value), "=a" (comparand) : "r" (input), "m" (*value), "a" (comparand) : "flags"); return comparand; }
 
+INLINE int32 atomic_or(int32 volatile* value, int32 input)
+{  return __sync_fetch_and_or(value, input); }
+
+INLINE int32 atomic_and(int32 volatile* value, int32 input)
+{  return __sync_fetch_and_and(value, input); }
+
 #if defined(__X86_64__)
 
   typedef int64 atomic_t;
@@ -175,10 +201,19 @@ INLINE int32 atomic_cmpxchg(int32 volatile* value, const int32 input, int32 comp
   INLINE int64 atomic_cmpxchg(int64 volatile* value, const int64 input, int64 comparand)
   {  asm volatile("lock cmpxchgq %2,%0" : "+m" (*value), "+a" (comparand) : "r" (input), "m" (*value), "r" (comparand) : "flags"); return comparand;  }
 
+  INLINE int64 atomic_or(int64 volatile* value, int64 input)
+  {  return __sync_fetch_and_or(value, input);  }
+
+  INLINE int64 atomic_and(int64 volatile* value, int64 input)
+  {  return __sync_fetch_and_and(value, input);  }
+
 #else
 
   typedef int32 atomic_t;
 
+  INLINE int64 atomic_cmpxchg(int64 volatile* value, const int64 input, int64 comparand)
+  {  return __sync_val_compare_and_swap(value, comparand, input);  }
+
 #endif /* defined(__X86_64__) */
 
 #define PF_COMPILER_READ_WRITE_BARRIER    asm volatile("" ::: "memory");
@@ -203,5 +238,12 @@ INLINE void __store_release(volatile T *ptr, T x)
   *ptr = x; // for x86, store == store_release
   PF_COMPILER_READ_WRITE_BARRIER;
 }
+
+/*! Compare and swap a pointer (goes through the pointer sized integer one) */
+template <typename T>
+INLINE T* atomic_cmpxchg(T * volatile *ptr, T *x, T *comparand)
+{
+  return (T*) atomic_cmpxchg((volatile atomic_t*) ptr, (atomic_t) x, (atomic_t) comparand);
+}
 #endif /* __PF_INTRINSICS_H__ */
 
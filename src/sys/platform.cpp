@@ -57,6 +57,7 @@ namespace pf
 #if defined(__UNIX__)
 
 #include <sys/time.h>
+#include <unistd.h>
 
 namespace pf
 {
@@ -166,6 +166,10 @@
 #define CACHE_LINE 64
 #define CACHE_LINE_ALIGNED ALIGNED(CACHE_LINE)
 
+/*! Smallest memory page. Page aligned objects can be placed on a NUMA node */
+#define PAGE_BYTES 4096
+#define PAGE_ALIGNED ALIGNED(PAGE_BYTES)
+
 #ifdef __GNUC__
   #define MAYBE_UNUSED __attribute__((used))
 #else
@@ -78,6 +78,21 @@ namespace pf
     GetSystemInfo(&sysinfo);
     return sysinfo.dwNumberOfProcessors;
   }
+
+  /* return the number of NUMA nodes of the system */
+  int getNumberOfNumaNodes() {
+    ULONG highest = 0;
+    if (!GetNumaHighestNodeNumber(&highest)) return 1;
+    return int(highest) + 1;
+  }
+
+  /* return the NUMA node of the given logical thread */
+  int getNumaNodeOfLogicalThread(int thread) {
+    UCHAR node = 0;
+    if (thread < 0 || thread > 0xff) return 0;
+    if (!GetNumaProcessorNode(UCHAR(thread), &node) || node == 0xff) return 0;
+    return int(node);
+  }
 }
 #endif
 
@@ -89,9 +104,63 @@ namespace pf
 
 #include <stdio.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <vector>
 
 namespace pf
 {
+  /* Node of each logical thread as given by the CPU lists of the nodes in
+   * /sys/devices/system/node (something like "0-3,8-11")
+   */
+  struct NumaTopology {
+    NumaTopology(void) : nodeNum(0) {
+      DIR *dir = opendir("/sys/devices/system/node");
+      if (dir != NULL) {
+        while (struct dirent *entry = readdir(dir)) {
+          int node;
+          if (sscanf(entry->d_name, "node%d", &node) != 1 || node < 0) continue;
+          char path[256];
+          sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+          FILE *file = fopen(path, "r");
+          if (file == NULL) continue;
+          int first, last;
+          while (fscanf(file, "%d", &first) == 1) {
+            char sep = '\n';
+            last = first;
+            if (fscanf(file, "%c", &sep) == 1 && sep == '-')
+              if (fscanf(file, "%d%c", &last, &sep) < 1) break;
+            for (int thread = first; thread <= last; ++thread) {
+              if (thread >= int(nodeOf.size())) nodeOf.resize(thread + 1, 0);
+              nodeOf[thread] = node;
+            }
+            if (sep != ',') break;
+          }
+          fclose(file);
+          if (node >= nodeNum) nodeNum = node + 1;
+        }
+        closedir(dir);
+      }
+      if (nodeNum == 0) nodeNum = 1;
+    }
+    std::vector<int> nodeOf;
+    int nodeNum;
+  };
+
+  static const NumaTopology &getNumaTopology() {
+    static const NumaTopology topology;
+    return topology;
+  }
+
+  /* return the number of NUMA nodes of the system */
+  int getNumberOfNumaNodes() { return getNumaTopology().nodeNum; }
+
+  /* return the NUMA node of the given logical thread */
+  int getNumaNodeOfLogicalThread(int thread) {
+    const NumaTopology &topology = getNumaTopology();
+    if (thread < 0 || thread >= int(topology.nodeOf.size())) return 0;
+    return topology.nodeOf[thread];
+  }
+
   /* get the full path to the running executable */
   std::string getExecutableFileName() {
     char pid[32]; sprintf(pid, "/proc/%d/exe", getpid());
@@ -122,6 +191,10 @@ namespace pf
     if (_NSGetExecutablePath(buf, &size) != 0) return std::string();
     return std::string(buf);
   }
+
+  /* MacOS does not expose NUMA nodes */
+  int getNumberOfNumaNodes() { return 1; }
+  int getNumaNodeOfLogicalThread(int thread) { return 0; }
 }
 
 #endif
@@ -31,6 +31,12 @@ namespace pf
 
   /*! return the number of logical threads of the system */
   int getNumberOfLogicalThreads();
+
+  /*! return the number of NUMA nodes of the system (1 if unknown) */
+  int getNumberOfNumaNodes();
+
+  /*! return the NUMA node of the given logical thread (0 if unknown) */
+  int getNumaNodeOfLogicalThread(int thread);
 }
 
 #endif
@@ -19,14 +19,25 @@
 #include "sys/thread.hpp"
 #include "sys/mutex.hpp"
 #include "sys/condition.hpp"
+#include "sys/futex.hpp"
+#include "sys/fiber.hpp"
+#include "sys/bitmap.hpp"
 #include "sys/sysinfo.hpp"
 
 #include <vector>
 #include <cstdlib>
+#include <cstring>
 #include <emmintrin.h>
 #if !defined(__MSVC__)
 #include <stdint.h>
 #endif /* __MSVC__ */
+#if PF_TASK_IO
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif /* PF_TASK_IO */
 
 // One important remark about reference counting. Tasks are referenced
 // counted but we do not use Ref<Task> here. This is for performance reasons.
@@ -57,16 +68,20 @@ namespace pf
   ///////////////////////////////////////////////////////////////////////////
   class Task;          // Basically an asynchronous function with dependencies
   class TaskSet;       // Idem but can be run N times
+  class TaskRange;     // Idem but over blocks of elements
   class TaskAllocator; // Dedicated to allocate tasks and task sets
   class TaskScheduler; // Owns the complete system
+  class TaskReactor;   // Waits for the file descriptors of the I/O tasks
 
   /*! Structure used to issue ready-to-process tasks */
-  template <int elemNum>
   struct CACHE_LINE_ALIGNED TaskQueue
   {
   public:
     INLINE TaskQueue(void) {
-      for (uint32 i = 0; i < TaskPriority::NUM; ++i) head[i] = tail[i] = 0;
+      for (uint32 i = 0; i < TaskPriority::NUM; ++i) {
+        head[i] = 0;
+        tail.w[i] = 0;
+      }
     }
 
     /*! Return the bit mask of the four queues:
@@ -79,76 +94,127 @@ namespace pf
 #if defined(__MSVC__)
       // Unfortunately, VS does not support volatile __m128 variables
       PF_COMPILER_READ_WRITE_BARRIER;
-      __m128i t, h;
-      t.m128i_i64[0] = tail.v.m128i_i64[0];
+      __m128i t0, t1, h;
+      t0.m128i_i64[0] = tail.v[0].m128i_i64[0];
+      t0.m128i_i64[1] = tail.v[0].m128i_i64[1];
+      t1.m128i_i64[0] = tail.v[1].m128i_i64[0];
+      t1.m128i_i64[1] = tail.v[1].m128i_i64[1];
       h.m128i_i64[0] = head.v.m128i_i64[0];
-      t.m128i_i64[1] = tail.v.m128i_i64[1];
       h.m128i_i64[1] = head.v.m128i_i64[1];
       PF_COMPILER_READ_WRITE_BARRIER;
 #else
-      const __m128i t = __load_acquire(&tail.v);
+      const __m128i t0 = __load_acquire(&tail.v[0]);
+      const __m128i t1 = __load_acquire(&tail.v[1]);
       const __m128i h = __load_acquire(&head.v);
 #endif /* defined(__MSVC__) */
-      const __m128i len = _mm_sub_epi32(t, h);
+      // Only keep the tails (low part of each [epoch,tail] pair)
+      const __m128 t = _mm_shuffle_ps(_mm_castsi128_ps(t0),
+                                      _mm_castsi128_ps(t1),
+                                      _MM_SHUFFLE(2,0,2,0));
+      const __m128i len = _mm_sub_epi32(_mm_castps_si128(t), h);
       return _mm_movemask_ps(_mm_castsi128_ps(len));
     }
 
   protected:
-    Task * volatile tasks[TaskPriority::NUM][elemNum]; //!< All tasks currently stored
-    typedef MutexActive MutexType;                     //!< Not lock-free right now
-    MutexType mutex;
     union {
       INLINE volatile int32& operator[] (int32 prio) { return x[prio]; }
       volatile int32 x[TaskPriority::NUM];
       volatile __m128i v;
-    } head, tail;
+    } head;
+    /*! Each tail is paired with an epoch (high 32 bits) that the work stealing
+     *  queues use to invalidate pending steals
+     */
+    union {
+      INLINE volatile int32& operator[] (int32 prio) { return x[2*prio]; }
+      volatile int32 x[2*TaskPriority::NUM];
+      volatile int64 w[TaskPriority::NUM];
+      volatile __m128i v[2];
+    } tail;
     PF_ALIGNED_CLASS(CACHE_LINE);
   };
 
+  /*! Circular buffer of tasks used by the work stealing queues. When a queue
+   *  grows, the previous ring is retired but not freed since stealers may
+   *  still read it. Retired rings are freed with the queue
+   */
+  struct TaskRing
+  {
+    /*! elemNum must be a power of 2 */
+    static TaskRing *create(uint32 elemNum, TaskRing *prev);
+    /*! Free the ring and all the rings it retired */
+    static void destroy(TaskRing *ring);
+    INLINE Task *get(int32 index) const { return tasks[uint32(index) & mask]; }
+    INLINE void set(int32 index, Task *task) {
+      __store_release(&tasks[uint32(index) & mask], task);
+    }
+    INLINE uint32 getElemNum(void) const { return mask + 1; }
+    TaskRing *prev;          //!< Ring we replaced (NULL if none)
+    uint32 mask;             //!< elemNum - 1
+    Task * volatile tasks[1];//!< Actually elemNum tasks
+  };
+
   /*! For work stealing:
    *  - only the owner (ie the victim) inserts tasks
    *  - the owner picks up tasks in depth first order (LIFO)
    *  - the stealers pick up tasks in breadth first order (FIFO)
+   *  This is a Chase-Lev deque per priority: the owner only moves the head
+   *  and the stealers only move the tail (with a CAS). Stealers may take up
+   *  to PF_TASK_STEAL_MAX tasks at once (half of the queue at most). So, the
+   *  owner and the stealers only compete (with a CAS too) when fewer than
+   *  PF_TASK_STEAL_MAX tasks remain. When full, the ring is doubled up to
+   *  PF_TASK_QUEUE_MAX_SIZE
    */
-  template <int elemNum>
-  struct TaskWorkStealingQueue : TaskQueue<elemNum> {
-    TaskWorkStealingQueue(void)
-#if PF_TASK_STATICTICS
-      : statInsertNum(0), statGetNum(0), statStealNum(0)
-#endif /* PF_TASK_STATICTICS */
-    {}
+  struct TaskWorkStealingQueue : TaskQueue {
+    TaskWorkStealingQueue(void);
+    ~TaskWorkStealingQueue(void);
 
-    /*! No need to lock here since only the owner can push a task */
+    /*! No need to lock here since only the owner can push a task. Returns
+     *  false only when PF_TASK_QUEUE_MAX_SIZE tasks are already queued
+     */
     bool insert(Task &task);
-    /*! Both stealers and the victim can pick up a task: we lock */
+    /*! Only the owner picks up from the head. Lock-free */
     Task* get(void);
-    /*! Idem: we lock */
-    Task* steal(void);
+    /*! Stealers pick up a batch of at most maxNum tasks from the tail with a
+     *  single CAS. Return the number of tasks stolen. Lock-free
+     */
+    uint32 steal(Task **tasks, uint32 maxNum);
+    /*! Double the size of the ring of the given priority (owner only) */
+    bool grow(uint32 prio);
+    /*! Allocate new rings from the calling thread such that they live in
+     *  its memory (owner only, while the queue is empty)
+     */
+    void renewRings(void);
 
 #if PF_TASK_STATICTICS
     void printStats(void) {
       std::cout << "insertNum " << statInsertNum <<
                    ", getNum " << statGetNum <<
-                   ", stealNum " << statStealNum << std::endl;
+                   ", stealNum " << statStealNum <<
+                   ", stolenNum " << statStolenNum <<
+                   ", growNum " << statGrowNum << std::endl;
     }
-    Atomic32 statInsertNum, statGetNum, statStealNum;
+    Atomic32 statInsertNum, statGetNum, statStealNum, statStolenNum, statGrowNum;
 #endif /* PF_TASK_STATICTICS */
+  private:
+    /*! Build the [epoch,tail] pair of a priority lane */
+    static INLINE int64 makeTail(uint32 epoch, int32 tail) {
+      return int64((uint64(epoch) << 32) | uint64(uint32(tail)));
+    }
+    TaskRing * volatile ring[TaskPriority::NUM]; //!< Current ring per priority
   };
 
   /*! Tasks with affinity go here. For this queue:
    *  - any thread can push a task
    *  - only the owner can pick up tasks
+   *  This is an intrusive multi-producer / single-consumer queue per priority.
+   *  Producers push the tasks on a lock-free stack. When its FIFO is empty,
+   *  the owner grabs the complete stack at once and reverses it. There is no
+   *  capacity limit
    */
-  template <int elemNum>
-  struct TaskAffinityQueue : TaskQueue<elemNum> {
-    TaskAffinityQueue (void)
-#if PF_TASK_STATICTICS
-      : statInsertNum(0), statGetNum(0)
-#endif /* PF_TASK_STATICTICS */
-    {}
-
-    /*! All threads can insert a task. We need to lock */
-    bool insert(Task &task);
+  struct TaskAffinityQueue : TaskQueue {
+    TaskAffinityQueue(void);
+    /*! All threads can insert a task. Lock-free */
+    void insert(Task &task);
     /*! Only the owner can pick up tasks. No need to lock */
     Task* get(void);
 
@@ -159,6 +225,9 @@ namespace pf
     }
     Atomic32 statInsertNum, statGetNum;
 #endif /* PF_TASK_STATICTICS */
+  private:
+    Task * volatile stack[TaskPriority::NUM]; //!< Pushed by everyone (LIFO)
+    Task *fifo[TaskPriority::NUM];            //!< Owned by the owner (FIFO)
   };
 
   /*! We will switch off the thread if nothing can be run */
@@ -167,11 +236,64 @@ namespace pf
     TASK_THREAD_STATE_RUNNING  = 1,
     TASK_THREAD_STATE_DEAD     = 2,
     TASK_THREAD_STATE_OUTSIDE  = 3,
+    TASK_THREAD_STATE_WOKEN_UP = 4, // Woken up. Now counted as spinning
     TASK_THREAD_STATE_INVALID  = 0xffffffff
   };
 
-  /*! Per thread state required to run the tasking system */
-  class CACHE_LINE_ALIGNED TaskThread
+  /*! Runs a suspendable task. A fiber goes back to its caller when the task
+   *  is done or suspended. Since a suspended task can be resumed by any
+   *  thread, the caller is set each time the fiber is entered
+   */
+  struct TaskFiber
+  {
+    TaskFiber(void);
+    /*! Entry point of all the fibers. Runs the tasks one after the other */
+    static void main(TaskFiber *fiber);
+    Fiber fiber;      //!< Execution context and stack
+    Fiber *caller;    //!< Where to go back when the task is done or suspended
+    Task *task;       //!< Task to run
+    Task *nextToRun;  //!< Task returned by the run function
+    TaskFiber *next;  //!< Links the free fibers
+    bool suspended;   //!< The task waits for an event
+  };
+
+  /*! A task waiting for its deadline (in ticks) */
+  struct TaskTimer
+  {
+    Task *task;      //!< Task to start
+    uint64 tick;     //!< Deadline
+    TaskTimer *next; //!< Next timer in the same slot (or in the free list)
+  };
+
+  /*! Hierarchical timer wheel. Each level has 64 slots. A timer goes to the
+   *  first level where its deadline and the current tick share the upper
+   *  bits. When the current tick enters a slot of a higher level, its timers
+   *  are redistributed in the lower levels. Insertion and expiration are
+   *  therefore O(1) and the next tick to process is found with bit scans
+   */
+  class TaskTimerWheel
+  {
+  public:
+    TaskTimerWheel(uint64 current);
+    /*! Insert a timer (deadlines in the past expire at the next call) */
+    void insert(TaskTimer *timer);
+    /*! Return the list of the timers that expire before or at now */
+    TaskTimer *expire(uint64 now);
+    /*! First tick that requires some work (~0 if there is no timer) */
+    uint64 getNextTick(void) const;
+  private:
+    /*! Move the timers of the higher level slots the current tick enters */
+    void cascade(void);
+    enum { slotBits = 6, slotNum = 1 << slotBits, levelNum = 8 };
+    TaskTimer *slots[levelNum][slotNum]; //!< Timers per level and per slot
+    uint64 mask[levelNum];               //!< Non-empty slots per level
+    uint64 current;                      //!< Next tick to process
+  };
+
+  /*! Per thread state required to run the tasking system. It has its own
+   *  pages such that we can place it on the node of its thread
+   */
+  class PAGE_ALIGNED TaskThread
   {
   public:
     TaskThread(void);
@@ -183,26 +305,52 @@ namespace pf
      *  we know where to get the task to steal. If the ID is negative, we do not
      *  change the current victim to steal from.
      */
-    void wakeUp(int32 threadThatWakesMeUp = -1);
-    /*! Check without locking the state before waking up the threads */
-    void tryWakeUp(int32 threadThatWakesMeUp = -1);
-    /*! Yield the thread using a condition variable */
-    void sleep(void);
-    enum { queueSize = 512 };                //!< Number of task per queue
-    TaskWorkStealingQueue<queueSize> wsQueue;//!< Per thread work stealing queue
-    TaskAffinityQueue<queueSize> afQueue;    //!< Per thread affinity queue
+    bool wakeUp(int32 threadThatWakesMeUp = -1);
+    /*! Check the state before trying to wake up the thread */
+    bool tryWakeUp(int32 threadThatWakesMeUp = -1);
+    /*! Park the thread on its state word. A woken up thread is counted as a
+     *  spinning thief. Return true if it is still counted (only possible if
+     *  canSpin is true)
+     */
+    bool sleep(bool canSpin = false);
+    /*! Get a fiber from the pool (or create it) */
+    INLINE TaskFiber *newFiber(void);
+    /*! Put back the fiber in the pool */
+    INLINE void deleteFiber(TaskFiber *fiber);
+    /*! Context to go back to when leaving the fiber we run */
+    INLINE Fiber *getCurrentContext(void);
+    /*! Get a timer from the pool (or create it) */
+    INLINE TaskTimer *newTimer(void);
+    /*! Put back the timer in the pool */
+    INLINE void deleteTimer(TaskTimer *timer);
+    /*! Move our state and our queues to our node (called by our thread) */
+    void moveToNode(void);
+    TaskWorkStealingQueue wsQueue;  //!< Per thread work stealing queue
+    TaskAffinityQueue afQueue;      //!< Per thread affinity queue
     thread_t thread;                //!< System thread handle
     TaskScheduler *scheduler;       //!< It owns us
-    ConditionSys cond;              //!< Condition variable for state
-    MutexSys mutex;                 //!< Protects condition variable
-    volatile TaskThreadState state; //!< SLEEPING or RUNNING?
+    FutexSys futex;                 //!< We sleep on the state
+    volatile int32 state;           //!< SLEEPING or RUNNING?
     size_t threadID;                //!< Our ID in the tasking system
+    uint32 node;                    //!< NUMA node (real or simulated)
     uint32 victim;                  //!< Next thread to steal from
     uint32 toWakeUp;                //!< Next guy to wake up
+    volatile uint32 scheduledNum;   //!< Tasks pushed by this thread
+    volatile uint32 doneNum;        //!< Tasks run by this thread
+    Fiber *threadFiber;             //!< Context of the thread itself (lazy)
+    TaskFiber *freeFibers;          //!< Pool of fibers
+    TaskFiber *currentFiber;        //!< Fiber we are running on (if any)
+    Task *runningTask;              //!< Task whose run function executes
+    MutexActive *toUnlock;          //!< Released once the fiber is left
+    Task *toInject;                 //!< Pushed back once the fiber is left
+    uint32 runSomethingDepth;       //!< Nested runSomething calls
+    uint32 waitDepth;               //!< Nested waits running other tasks
+    TaskTimer *freeTimers;          //!< Pool of timers
+    uint32 timerCheck;              //!< getTask calls before reading the clock
 #if PF_TASK_STATICTICS
     Atomic sleepNum;
 #endif /* PF_TASK_STATICTICS */
-    PF_ALIGNED_CLASS(CACHE_LINE);
+    PF_ALIGNED_CLASS(PAGE_BYTES);
   };
 
   /*! Handle the scheduling of all tasks. We first implement a
@@ -210,13 +358,16 @@ namespace pf
    *  up task in depth first order. Each thread can also steal other tasks
    *  in breadth first order when his own queue is empty. Each thread also
    *  maintains a FIFO queue that contains jobs that it is the only to run
-   *  (this is called "affinity" queue)s
+   *  (this is called "affinity" queue)s. On NUMA systems, the thieves first
+   *  look at the threads of their own node
    */
   class CACHE_LINE_ALIGNED TaskScheduler
   {
   public:
-    /*! If threadNum == 0, use the maximum number of threads */
-    TaskScheduler(int threadNum_ = -1);
+    /*! If threadNum == 0, use the maximum number of threads. If nodeNum is
+     *  not 0, the threads are split in nodeNum simulated NUMA nodes
+     */
+    TaskScheduler(int threadNum_ = -1, uint32 nodeNum_ = 0);
     ~TaskScheduler(void);
     /*! Call by the main thread to enter the tasking system */
     void go(void);
@@ -233,10 +384,31 @@ namespace pf
       this->profiler = profiler_;
     }
 #endif /* PF_TASK_PROFILER */
+    /*! Ignore the spinning threads when waking up (see wakeUpOne) */
+    INLINE void setWakeUpAlways(bool always) { this->wakeUpAlways = always; }
     /*! Number of threads running in the scheduler (not including main) */
     INLINE uint32 getWorkerNum(void) { return uint32(this->workerNum); }
     /*! ID of the calling thread in the tasking system */
-    INLINE uint32 getThreadID(void) { return uint32(this->threadID); }
+    INLINE uint32 getThreadID(void) {
+      return this->isForeign() ? PF_TASK_FOREIGN_THREAD : uint32(this->threadID);
+    }
+    /*! True if the calling thread is outside the tasking system */
+    INLINE bool isForeign(void) const { return this->threadID >= this->queueNum; }
+    /*! NUMA node (real or simulated) of the given thread */
+    INLINE uint32 getNode(uint32 id) const { return this->taskThread[id].node; }
+    /*! Steals done by the threads of thiefNode from the ones of victimNode */
+    INLINE uint64 getStealNum(uint32 thiefNode, uint32 victimNode) const {
+      uint64 num = 0;
+      if (victimNode >= this->nodeNum) return 0;
+      for (uint32 id = 0; id < this->queueNum; ++id)
+        if (this->getNode(id) == thiefNode)
+          num += this->stealNum[id * this->stealStride + victimNode];
+      return num;
+    }
+    /*! Node where the memory of the given thread goes (-1 if we do not care) */
+    INLINE int32 getMemoryNode(uint32 id) const {
+      return this->bindMemory ? int32(this->taskThread[id].node) : -1;
+    }
     /*! Try to get a task from all the current queues */
     INLINE Task* getTask(void);
     /*! Run the task and recursively handle the tasks to start and to end */
@@ -245,10 +417,70 @@ namespace pf
     void lock(void);
     /*! Unlock the scheduler */
     void unlock(void);
-    /*! Wait the task completion */
+    /*! Wait the task completion (helps by running other tasks) */
     void wait(Ref<Task> task);
+    /*! Suspend the running task or help until the event is signaled */
+    void wait(TaskEvent &event);
+    /*! Block a foreign thread until the event is signaled */
+    void waitForeign(TaskEvent &event);
+    /*! Wake up the foreign threads blocked on an event */
+    void signalForeign(void);
+    /*! Push back a task suspended by an event */
+    void resume(Task &task);
     /*! Wait until all queues are empty */
     void waitAll(void);
+    /*! Run one task if any. Return false if nothing was run */
+    bool runSomething(void);
+#if PF_TASK_IO
+    /*! Hand the running I/O task to the reactor. It will run again */
+    void waitIO(TaskIO &task);
+#endif /* PF_TASK_IO */
+    /*! Start the task in ms milliseconds (the timer holds a start
+     *  dependency)
+     */
+    void addTimer(Task &task, uint32 ms);
+    /*! Start the tasks of the expired timers */
+    void fireTimers(void);
+    /*! Become the thread that sleeps until the next deadline (if there is
+     *  none yet). Return the sleeping time or -1 if we are not the keeper
+     */
+    int64 keepTime(uint32 id);
+    /*! Give back the time keeper role */
+    void releaseTime(uint32 id);
+    /*! Push a task from a thread outside the tasking system. The task must
+     *  be already counted (as scheduled) by a thread of the tasking system
+     */
+    void pushForeign(Task &task);
+    /*! Schedule a task from a thread outside the tasking system. It is
+     *  counted here and goes through the injection queue
+     */
+    void scheduleForeign(Task &task);
+    /*! Push a task in the injection queue (lock-free) */
+    INLINE void inject(Task &task);
+    /*! Take all the injected tasks. Return the oldest one and push the other
+     *  ones in our queue (NULL if none)
+     */
+    Task *takeInjected(void);
+    /*! Wake up a sleeping thread if no thread is looking for tasks */
+    INLINE void wakeUpOne(void);
+    /*! Threads of the given node in the occupied and sleeping bitmaps */
+    INLINE const size_t *getNodeMask(uint32 node) const {
+      return this->nodeMask + node * this->occupied.getWordNum();
+    }
+    /*! Find a thread with tasks to steal among the threads of mask (all of
+     *  them if NULL). Return -1 if there is none but us
+     */
+    INLINE int32 findVictim(uint32 from, const size_t *mask) const;
+    /*! Set the occupancy bit of the given thread (if not set) */
+    INLINE void setOccupied(uint32 id);
+    /*! Clear the occupancy bit of the given thread if its queue is empty */
+    INLINE void clearOccupied(uint32 id);
+    /*! Look at all work stealing queues (and fix the occupancy bitmap) */
+    bool hasStealableTasks(void);
+    /*! True if some tasks are still in the queues or running */
+    bool hasOutstandingTasks(void) const;
+    /*! Wake up the main thread if it waits for all tasks and nothing remains */
+    void checkWaitAll(void);
     /*! Data provided to each thread */
     struct ThreadStartup {
       ThreadStartup(size_t tid, TaskScheduler &scheduler_) :
@@ -264,10 +496,22 @@ namespace pf
     INLINE void schedule(Task &task);
     /*! Try to push a task in the queue. Returns false if queues are full */
     INLINE bool trySchedule(Task &task);
+    /*! Same as trySchedule but the task is not counted as a new one */
+    INLINE bool tryPush(Task &task);
+    /*! Run (or resume) the task in a fiber. Return true if it got suspended */
+    INLINE bool runInFiber(Task &task, Task *&nextToRun);
+    /*! Run one task for a waiting thread. Return false if nothing was run */
+    INLINE bool help(void);
+    /*! Suspend the task running on the fiber and push it back right away */
+    INLINE void yieldFiber(TaskFiber &fiber);
+    /*! Spin a bit when a waiting thread has nothing to run. Yield after */
+    static INLINE void backOff(uint32 &tryNum);
     friend class Task;            //!< Tasks ...
     friend class TaskSet;         // ... task sets ...
+    friend class TaskRange;       // ... task ranges ...
     friend class TaskAllocator;   // ... task allocator use the tasking system
     friend class TaskThread;      //!< Update the sleeping bitfield
+    friend class TaskIO;          //!< Hands itself to the reactor
     static THREAD uint32 threadID;//!< ThreadID for each thread
     TaskThread *taskThread;       //!< Per thread state
 #if PF_TASK_PROFILER
@@ -275,15 +519,140 @@ namespace pf
 #endif /* PF_TASK_PROFILER */
     size_t workerNum;             //!< Total number of threads running
     size_t queueNum;              //!< Number of queues (should be workerNum+1)
-    volatile size_t sleeping;     //!< Bitfields that gives the sleeping threads
-    volatile size_t sleepingNum;  //!< Number of threads sleeping
-    MutexActive sleepMutex;       //!< Protect the sleeping field
+    Bitmap sleeping;              //!< Bitfields that gives the sleeping threads
+    volatile atomic_t sleepingNum;//!< Number of threads sleeping
+    volatile atomic_t spinningNum;//!< Number of threads looking for tasks
+    volatile bool wakeUpAlways;   //!< Wake up even if some threads spin
+    volatile int32 waitingAll;    //!< Main thread sleeps in waitAll
+    Bitmap occupied;              //!< Threads with tasks to steal
+    uint32 nodeNum;               //!< NUMA nodes (real or simulated)
+    size_t *nodeMask;             //!< Threads of each node (see getNodeMask)
+    uint64 *stealNum;             //!< Steals per thief and per victim node
+    uint32 stealStride;           //!< Counters per thief (padded)
+    bool bindMemory;              //!< True if the nodes are real ones
+#if PF_TASK_IO
+    TaskReactor *reactor;         //!< Waits for the I/O tasks
+#endif /* PF_TASK_IO */
+    Atomic32 foreignNum;          //!< Spreads the foreign tasks
+    Atomic32 injectedNum;         //!< Tasks scheduled by the foreign threads
+    CACHE_LINE_ALIGNED Task * volatile injected; //!< Pushed by foreign threads
+    MutexSys foreignMutex;        //!< Foreign threads block on events with it
+    ConditionSys foreignCond;     //!< Signaled events wake them up with it
+    TaskTimerWheel timers;        //!< Delayed tasks
+    MutexActive timerMutex;       //!< Protects the timer wheel
+    volatile int32 timerNum;      //!< Number of pending timers
+    volatile int64 nextTimerTick; //!< Next tick to process (read without lock)
+    int32 timeKeeper;             //!< Thread sleeping until the next deadline
+    uint64 timeKeeperTick;        //!< When it wakes up
     CACHE_LINE_ALIGNED volatile int32 locked; //!< To globally lock the tasking system
     PF_ALIGNED_CLASS(CACHE_LINE);
   };
 
-  /*! Allocator per thread */
-  class CACHE_LINE_ALIGNED TaskStorage
+#if PF_TASK_IO
+  /*! Like the worker threads, the reactor has its own system thread. It only
+   *  waits for the descriptors of the I/O tasks with epoll (one shot) and
+   *  pushes the tasks back in the tasking system when they are ready
+   */
+  class TaskReactor
+  {
+  public:
+    TaskReactor(TaskScheduler &scheduler);
+    ~TaskReactor(void);
+    /*! Wait for the descriptor of the task */
+    void wait(TaskIO &task);
+    /*! Forget the descriptor of the task */
+    void remove(TaskIO &task);
+  private:
+    /*! The tasks waiting for one descriptor (a task that reads and writes
+     *  is in both slots)
+     */
+    struct Waiters {
+      INLINE Waiters(void) : reader(NULL), writer(NULL) {}
+      TaskIO *reader, *writer;
+    };
+    /*! Register the descriptor for what its waiters need (mutex is locked) */
+    bool arm(int fd);
+    /*! Function run by the reactor thread */
+    static void threadFunction(TaskReactor *reactor);
+    TaskScheduler &scheduler;     //!< Where to push the ready tasks
+    std::vector<Waiters> waiters; //!< Per descriptor
+    MutexActive mutex;            //!< Protects the waiters
+    thread_t thread;              //!< System thread handle
+    int epollFD;                  //!< All descriptors we wait for
+    int stopFD;                   //!< Signaled to kill the reactor thread
+  };
+#endif /* PF_TASK_IO */
+
+  /*! Stored at the beginning of each chunk of tasks */
+  struct TaskChunk
+  {
+    uint32 elemSize; //!< Size of the tasks of the chunk
+    uint16 chunkID;  //!< Heap the tasks belong to
+    uint16 elemNum;  //!< Number of tasks in the chunk (0 if not pooled)
+    uint32 freeNum;  //!< Free tasks found in the global heap by the reclaimer
+    uint32 owner;    //!< Thread whose storage gets the free tasks back
+  };
+
+  /*! Lock-free stack of free lists (one per heap in the global heaps). A list
+   *  is linked to the next one with its second pointer. The top packs the
+   *  pointer with a tag incremented by every update to avoid ABA issues: a
+   *  list popped and pushed back meanwhile does not match the old top. Popping
+   *  may read the link of a list already taken by another thread. This is
+   *  fine since the chunks are only freed with the allocator
+   */
+  struct CACHE_LINE_ALIGNED TaskFreeStack
+  {
+    INLINE TaskFreeStack(void) : top(0) {}
+    /*! Push a list of free tasks */
+    INLINE void push(void *list) {
+      for (;;) {
+        const int64 old = __load_acquire(&this->top);
+        ((void**) list)[1] = getPtr(old);
+        if (atomic_cmpxchg(&this->top, makeTop(list, old), old) == old) return;
+      }
+    }
+    /*! Pop a list of free tasks (NULL if empty) */
+    INLINE void *pop(void) {
+      for (;;) {
+        const int64 old = __load_acquire(&this->top);
+        void *list = getPtr(old);
+        if (list == NULL) return NULL;
+        void *next = ((void**) list)[1];
+        if (atomic_cmpxchg(&this->top, makeTop(next, old), old) == old)
+          return list;
+      }
+    }
+    /*! Take all the lists at once */
+    INLINE void *popAll(void) {
+      for (;;) {
+        const int64 old = __load_acquire(&this->top);
+        if (getPtr(old) == NULL) return NULL;
+        if (atomic_cmpxchg(&this->top, makeTop(NULL, old), old) == old)
+          return getPtr(old);
+      }
+    }
+    INLINE bool empty(void) const { return getPtr(this->top) == NULL; }
+  private:
+#if defined(__X86_64__)
+    enum { ptrBits = 48 }; //!< User space addresses fit in 48 bits
+#else
+    enum { ptrBits = 32 };
+#endif /* defined(__X86_64__) */
+    static INLINE void *getPtr(int64 top) {
+      return (void *) uintptr_t(uint64(top) & ((uint64(1) << ptrBits) - 1));
+    }
+    static INLINE int64 makeTop(void *ptr, int64 old) {
+      const uint64 tag = (uint64(old) >> ptrBits) + 1;
+      return int64((tag << ptrBits) | uint64(uintptr_t(ptr)));
+    }
+    volatile int64 top; //!< Tagged pointer to the first list
+    PF_ALIGNED_CLASS(CACHE_LINE);
+  };
+
+  /*! Allocator per thread. It has its own pages such that we can place it
+   *  on the node of its thread
+   */
+  class PAGE_ALIGNED TaskStorage
   {
   public:
     TaskStorage(void) :
@@ -291,32 +660,86 @@ namespace pf
       statNewChunkNum(0), statPushGlobalNum(0), statPopGlobalNum(0),
       statAllocateNum(0), statDeallocateNum(0),
 #endif /* PF_TASK_STATICTICS */
-      allocator(NULL), allocateNum(0)
+      allocator(NULL), id(0), node(-1), regionCurr(NULL), regionEnd(NULL),
+      allocateNum(0), remote(NULL), remoteNum(0)
     {
       for (size_t i = 0; i < maxHeap; ++i) {
         this->chunk[i] = NULL;
         this->currSize[i] = 0u;
       }
+#if PF_TASK_STATICTICS
+      std::memset(statHeapAllocateNum, 0, sizeof(statHeapAllocateNum));
+      std::memset(statHeapDeallocateNum, 0, sizeof(statHeapDeallocateNum));
+      std::memset(statHeapRequested, 0, sizeof(statHeapRequested));
+#endif /* PF_TASK_STATICTICS */
     }
     ~TaskStorage(void) {
-      for (size_t i = 0; i < toFree.size(); ++i) PF_ALIGNED_FREE(toFree[i]);
+      for (size_t i = 0; i < regions.size(); ++i)
+        unmapPages(regions[i], regionSize);
     }
 
-    /*! Will try to allocate from the local storage. Use std::malloc to
-     *  allocate a new local chunk
+    /*! Will try to allocate from the local storage. Cut a new chunk from
+     *  our region if there is no free task
      */
-    INLINE void *allocate(size_t sz);
+    INLINE void *allocate(size_t sz, uint32 chunkID);
     /*! Free a task and put it in a free list. If too many tasks are
      *  deallocated, return a piece of it to the global heap
      */
     INLINE void deallocate(void *ptr);
+    /*! Put a task of ours freed by another thread in the remote list */
+    INLINE void pushRemote(void *ptr);
+    /*! Take back the tasks freed by the other threads */
+    void popRemote(void);
+    /*! Move the tasks freed by the other threads to the global heap */
+    void flushRemote(void);
     /*! Create a free list and store chunk information */
     void newChunk(uint32 chunkID);
+    /*! Cut a chunk from the current region (map a new one if needed) */
+    void *cutChunk(size_t bytes);
+    /*! Allocate a task too large for the heaps with its own chunk */
+    void *allocateHuge(size_t sz);
     /*! Push back a group of tasks in the global heap */
     void pushGlobal(uint32 chunkID);
     /*! Pop a group of tasks from the global heap (if none, return NULL) */
     void popGlobal(uint32 chunkID);
 
+    enum { minChunkSize = 1 << 12 }; //!< One page
+    enum { maxChunkSize = 1 << 20 }; //!< The task number must fit in 16 bits
+    enum { regionSize = PF_TASK_REGION_SIZE }; //!< Chunks are cut from regions
+    enum { headerSize = sizeof(TaskChunk) }; //!< Tasks follow the header
+    enum { batchSize = 1 << 12 }; //!< Bytes of small tasks moved at once
+    enum { maxHeap = 39u };      //!< One heap per size class
+    static uintptr_t chunkSize;  //!< Chunks are aligned on their size
+    static uint32 smallHeapNum;  //!< Heaps with several tasks per chunk
+    /*! Set the chunk size before allocating anything */
+    static void setChunkSize(size_t size);
+    /*! Chunk header of a task. A task is always in the first chunkSize
+     *  bytes of its chunk
+     */
+    static INLINE TaskChunk *getChunk(void *ptr) {
+      return (TaskChunk *) (uintptr_t(ptr) & ~(chunkSize - 1));
+    }
+    enum { maxLookupSize = 1024 }; //!< Size classes found with a table
+    static const uint32 heapSize[maxHeap]; //!< Task size per heap
+    static uint8 heapOfSize[maxLookupSize / 16 + 1]; //!< Heap per 16 bytes
+    /*! Fill the size to heap table */
+    static void initHeapOfSize(void);
+    /*! Smallest heap with tasks of at least sz bytes */
+    static INLINE uint32 getHeapID(size_t sz) {
+      if (LIKELY(sz <= maxLookupSize)) return heapOfSize[(sz + 15) >> 4];
+      uint32 chunkID = heapOfSize[maxLookupSize >> 4];
+      while (heapSize[chunkID] < sz) ++chunkID;
+      return chunkID;
+    }
+    /*! The largest tasks have their own chunk (header + task) */
+    static INLINE size_t getChunkBytes(uint32 chunkID) {
+      if (chunkID < smallHeapNum) return chunkSize;
+      return (headerSize + heapSize[chunkID] + chunkSize - 1) & ~(chunkSize - 1);
+    }
+    /*! Free bytes moved at once between the local and global heaps */
+    static INLINE uint32 getBatchSize(uint32 chunkID) {
+      return chunkID < smallHeapNum ? uint32(batchSize) : 4u * heapSize[chunkID];
+    }
 #if PF_TASK_STATICTICS
     void printStats(void) {
       std::cout << "newChunkNum " << statNewChunkNum <<
@@ -327,29 +750,57 @@ namespace pf
     }
     Atomic statNewChunkNum, statPushGlobalNum, statPopGlobalNum;
     Atomic statAllocateNum, statDeallocateNum;
+    int64 statHeapAllocateNum[maxHeap];   //!< Allocations per heap
+    int64 statHeapDeallocateNum[maxHeap]; //!< Deallocations per heap
+    int64 statHeapRequested[maxHeap];     //!< Sum of the requested sizes per heap
 #endif /* PF_TASK_STATICTICS */
 
   private:
     friend class TaskAllocator;
-    enum { logChunkSize = 12 };           //!< log2(4KB)
-    enum { chunkSize = 1<<logChunkSize }; //!< 4KB when taking memory from std
-    enum { maxHeap = 10u };      //!< One heap per size (only power of 2)
-    TaskAllocator *allocator;    //!< Handles global heap
-    std::vector<void*> toFree;   //!< All chunks allocated (per thread)
+    /*! All the small heaps share the same chunk size */
+    static INLINE uint32 getChunkClass(uint32 chunkID) {
+      return chunkID < smallHeapNum ? 0u : chunkID - smallHeapNum + 1;
+    }
+    enum { chunkClassNum = maxHeap + 1 };
+    /*! Put a task of ours back in its free list */
+    INLINE void freeLocal(void *ptr, TaskChunk *header);
+    /*! Take the whole remote list */
+    INLINE void *takeRemote(void);
+    TaskAllocator *allocator;    //!< Handles released chunks
+    uint32 id;                   //!< Thread owning this storage
+    int32 node;                  //!< NUMA node of the regions (-1 if any)
+    std::vector<void*> regions;  //!< All regions mapped (per thread)
+    char *regionCurr;            //!< Where to cut the next chunk
+    char *regionEnd;             //!< End of the current region
     void *chunk[maxHeap];        //!< One heap per size
     uint32 currSize[maxHeap];    //!< Sum of the free task sizes
-    int64 allocateNum;           //!< Signed because we can free a task
-                                 //   that was allocated elsewhere
+    TaskFreeStack global[maxHeap]; //!< Free lists the reclaimer may release
+    int64 allocateNum;           //!< Tasks allocated minus tasks freed by us
+    CACHE_LINE_ALIGNED void * volatile remote; //!< Freed by other threads
+    Atomic remoteNum;            //!< Tasks freed by the other threads
+    CACHE_LINE_ALIGNED MutexActive mutex; //!< Only for the foreign threads
+    PF_ALIGNED_CLASS(PAGE_BYTES);
   };
 
   /*! TaskAllocator will speed up task allocation with fast dedicated thread
-   *  local storage and fixed size allocation strategy. Each thread maintains
-   *  its own list of free tasks. When empty, it first tries to get some tasks
-   *  from the global task heap. If the global heap is empty, it just allocates
-   *  a new pool of task with a std::malloc. If the local pool is "full", a
-   *  chunk of tasks is pushed back into the global heap. Note that the task
-   *  allocator is really a growing pool. We *never* give back the chunk of
-   *  memory taken from std::malloc (except when the allocator is destroyed)
+   *  local storage and fixed size allocation strategy. Each thread owns the
+   *  chunks it allocates and maintains its own list of free tasks. A task
+   *  freed by another thread goes back to its owner through a lock-free
+   *  remote list. When its free list is empty, a thread first takes back its
+   *  remote tasks, then tries its global heap. If the global heap is empty, it
+   *  cuts a new chunk from its current region. If the local pool
+   *  is "full", a chunk of tasks is pushed back into the global heap. When the
+   *  global heaps hold too much memory (see highWater), a low priority task
+   *  looks for the chunks whose tasks are all in a global heap and gives their
+   *  pages back to the system. These chunks are reused (by any thread) before
+   *  allocating new ones. We only unmap the regions when the allocator is
+   *  destroyed. On NUMA systems, the storage and the regions of a thread are
+   *  placed on its node. Tasks smaller than a chunk (4KB by default) share
+   *  chunks. Larger ones up to maxSize have their own chunk but still go
+   *  through the local and global heaps. Beyond, they are directly allocated
+   *  and freed. Threads outside the tasking system share
+   *  PF_TASK_FOREIGN_STORAGE_NUM extra storages with a lock each. They free
+   *  their tasks through the remote lists
    */
   class TaskAllocator
   {
@@ -357,153 +808,443 @@ namespace pf
     /*! Constructor. Here this is the total number of threads using the pool (ie
      *  number of worker threads + main thread)
      */
-    TaskAllocator(uint32 threadNum);
+    TaskAllocator(uint32 threadNum, size_t chunkSize);
     ~TaskAllocator(void);
     void *allocate(size_t sz);
     void deallocate(void *ptr);
+    /*! Allocate from the storage of the calling foreign thread (locked) */
+    void *allocateForeign(size_t sz);
+    /*! Get a chunk previously given back to the system (NULL if none) */
+    void *getReleasedChunk(uint32 chunkID);
+    /*! Spawn the reclaimer task if the global heap is above the high water
+     *  mark and no reclaimer is already running
+     */
+    void reclaimIfNeeded(void);
+    /*! Give the free chunks of the global heaps back to the system */
+    void reclaim(void);
+    /*! Reclaim the chunks of one global heap */
+    void reclaimHeap(TaskFreeStack &heap, uint32 chunkID,
+                     std::vector<void*> &toRelease);
+    /*! Memory taken from the system and not released */
+    size_t getMemory(void) const;
+    /*! Bytes really used by a task of sz bytes */
+    static size_t getSizeClass(size_t sz);
+    /*! Set the global heap size that starts a reclaimer */
+    void setHighWater(size_t bytes);
+    /*! Place the storage of the given thread and its regions on a node */
+    void setNode(uint32 id, int32 node);
     enum { maxHeap = TaskStorage::maxHeap };
-    enum { maxSize = 1 << maxHeap };
-    TaskStorage *local;    //!< Local heaps (per thread and per size)
-    void *global[maxHeap]; //!< Global heap shared by all threads
-    MutexActive mutex;     //!< To protect the global heap
-    uint32 threadNum;      //!< One thread storage per thread
+    enum { maxSize = 65520 }; //!< Size of the last heap
+    TaskStorage *local;          //!< Local heaps (per thread and per size)
+    std::vector<void*> released[TaskStorage::chunkClassNum]; //!< Given back
+    size_t releasedSize;         //!< Bytes given back to the system
+    Atomic globalSize;           //!< Bytes in the global heaps
+    volatile size_t highWater;   //!< Global heap size that starts a reclaimer
+    Atomic memorySize;           //!< Bytes taken from the system so far
+    Atomic pushNum;              //!< Lists pushed in the global heaps so far
+    volatile int32 reclaiming;   //!< 1 when a reclaimer is pending
+    MutexActive mutex;           //!< To protect the released chunks
+    Atomic32 foreignNum;         //!< Spreads the foreign threads
+    uint32 threadNum;            //!< One thread storage per thread
+    uint32 storageNum;           //!< Plus the ones of the foreign threads
   };
 
+  /*! The worker threads also use it before sleeping */
+  static TaskAllocator *allocator = NULL;
+
   ///////////////////////////////////////////////////////////////////////////
   /// Implementation of the internal classes of the tasking system
   ///////////////////////////////////////////////////////////////////////////
 
+  TaskRing *TaskRing::create(uint32 elemNum, TaskRing *prev) {
+    PF_ASSERT(isPowerOf<2>(elemNum));
+    const size_t size = sizeof(TaskRing) + (elemNum - 1) * sizeof(Task*);
+    TaskRing *ring = (TaskRing *) PF_ALIGNED_MALLOC(size, CACHE_LINE);
+    ring->prev = prev;
+    ring->mask = elemNum - 1;
+    return ring;
+  }
+
+  void TaskRing::destroy(TaskRing *ring) {
+    while (ring) {
+      TaskRing *prev = ring->prev;
+      PF_ALIGNED_FREE(ring);
+      ring = prev;
+    }
+  }
+
+  TaskWorkStealingQueue::TaskWorkStealingQueue(void)
+#if PF_TASK_STATICTICS
+    : statInsertNum(0), statGetNum(0), statStealNum(0), statStolenNum(0),
+      statGrowNum(0)
+#endif /* PF_TASK_STATICTICS */
+  {
+    for (uint32 i = 0; i < TaskPriority::NUM; ++i)
+      this->ring[i] = TaskRing::create(PF_TASK_QUEUE_INIT_SIZE, NULL);
+  }
+
+  // Stealers do not read the ring of an empty queue. Even if one still holds
+  // the previous ring, the ring is retired and not freed
+  void TaskWorkStealingQueue::renewRings(void) {
+    for (uint32 i = 0; i < TaskPriority::NUM; ++i) {
+      PF_ASSERT(this->head[i] == this->tail[i]);
+      TaskRing *old = this->ring[i];
+      __store_release(&this->ring[i], TaskRing::create(old->getElemNum(), old));
+    }
+  }
+
+  TaskWorkStealingQueue::~TaskWorkStealingQueue(void) {
+    for (uint32 i = 0; i < TaskPriority::NUM; ++i)
+      TaskRing::destroy(this->ring[i]);
+  }
+
+  // Only the owner grows the ring. We copy everything between the tail and
+  // the head and then publish the new ring. Stealers that still use the old
+  // one either read a valid task (the old ring is not modified anymore) or
+  // fail their CAS. Since the ring is published before the head moves, a
+  // stealer that sees the new head also sees the new ring
+  bool TaskWorkStealingQueue::grow(uint32 prio) {
+    TaskRing *old = this->ring[prio];
+    const uint32 elemNum = old->getElemNum();
+    if (elemNum >= uint32(PF_TASK_QUEUE_MAX_SIZE)) return false;
+    TaskRing *ring = TaskRing::create(2 * elemNum, old);
+    const int32 head = this->head[prio];
+    const uint32 tail = __load_acquire(&this->tail[prio]);
+    for (uint32 i = tail; i != uint32(head); ++i)
+      ring->set(int32(i), old->get(int32(i)));
+    __store_release(&this->ring[prio], ring);
+    IF_TASK_STATISTICS(statGrowNum++);
+    return true;
+  }
+
   // Insertion is only done by the owner of the queues. So, the owner is the
   // only one that modifies the head (since this is the only one that inserts).
-  // With proper store_releases, we therefore do not need any lock
-  template<int elemNum>
-  bool TaskWorkStealingQueue<elemNum>::insert(Task &task) {
+  // With proper store_releases, we therefore do not need any lock. Note that
+  // head and tail are free running counters. We only compare them with
+  // differences to properly handle the wrap around
+  bool TaskWorkStealingQueue::insert(Task &task) {
     const uint32 prio = task.getPriority();
-    if (UNLIKELY(this->head[prio] - this->tail[prio] == elemNum))
-      return false;
+    const int32 head = this->head[prio];
+    const uint32 size = uint32(head) - uint32(this->tail[prio]);
+    if (UNLIKELY(size >= this->ring[prio]->getElemNum()))
+      if (UNLIKELY(!this->grow(prio)))
+        return false;
     __store_release(&task.state, uint8(TaskState::READY));
-    __store_release(&this->tasks[prio][this->head[prio] % elemNum], &task);
-    const int32 nextHead = this->head[prio] + 1;
-    __store_release(&this->head[prio], nextHead);
+    this->ring[prio]->set(head, &task);
+    __store_release(&this->head[prio], int32(uint32(head) + 1));
     IF_TASK_STATISTICS(statInsertNum++);
     return true;
   }
 
-  // get is competing with steal: we use a lock
-  template<int elemNum>
-  Task* TaskWorkStealingQueue<elemNum>::get(void) {
-    if (this->getActiveMask() == 0) return NULL;
-    Lock<typename TaskQueue<elemNum>::MutexType> lock(this->mutex);
-    const int mask = this->getActiveMask();
-    if (mask == 0) return NULL;
-    const uint32 prio = __bsf(mask);
-    const int32 index = this->head[prio] - 1;
-    __store_release(&this->head[prio], index);
-    Task* task = this->tasks[prio][index % elemNum];
-    IF_TASK_STATISTICS(statGetNum++);
-    return task;
+  // A stealer that read [epoch,tail] takes at most PF_TASK_STEAL_MAX tasks
+  // from the tail. First, we "reserve" the head task by moving the head. The
+  // fence makes this reservation visible before we read the tail. Then:
+  // - if at least PF_TASK_STEAL_MAX tasks are in front of it, nobody can
+  //   steal it. The task is ours without any atomic operation
+  // - if this is the last task, we dispute it with a CAS on the tail
+  // - otherwise, we increment the epoch with a CAS. This makes fail all the
+  //   pending steals that did not see the new head. The other ones won't go
+  //   beyond the new head since they only steal half of what they see
+  Task* TaskWorkStealingQueue::get(void) {
+    int mask;
+    while ((mask = this->getActiveMask()) != 0) {
+      const uint32 prio = __bsf(mask);
+      const int32 index = int32(uint32(this->head[prio]) - 1);
+      __store_release(&this->head[prio], index);
+      memoryFence();
+      Task *task = NULL;
+      for (;;) {
+        const int64 tail = __load_acquire(&this->tail.w[prio]);
+        const uint32 epoch = uint32(uint64(tail) >> 32);
+        const int32 remaining = int32(uint32(index) - uint32(tail));
+        if (LIKELY(remaining >= PF_TASK_STEAL_MAX)) {
+          IF_TASK_STATISTICS(statGetNum++);
+          return this->ring[prio]->get(index);
+        }
+        if (remaining < 0) break; // Stolen
+        task = this->ring[prio]->get(index);
+        const int64 next = remaining == 0 ? makeTail(epoch, int32(tail) + 1)
+                                          : makeTail(epoch + 1, int32(tail));
+        if (atomic_cmpxchg(&this->tail.w[prio], next, tail) == tail) {
+          if (remaining == 0) break; // Last one: the queue is now empty
+          IF_TASK_STATISTICS(statGetNum++);
+          return task;
+        }
+        task = NULL; // Some stealer was faster. Check again what remains
+      }
+      // The queue is empty now. Put back the head after the tail
+      __store_release(&this->head[prio], int32(uint32(index) + 1));
+      if (task) {
+        IF_TASK_STATISTICS(statGetNum++);
+        return task;
+      }
+    }
+    return NULL;
   }
 
-  // Idem
-  template<int elemNum>
-  Task* TaskWorkStealingQueue<elemNum>::steal(void) {
-    if (this->getActiveMask() == 0) return NULL;
-    Lock<typename TaskQueue<elemNum>::MutexType> lock(this->mutex);
-    const int mask = this->getActiveMask();
-    if (mask == 0) return NULL;
-    const uint32 prio = __bsf(mask);
-    const int32 index = this->tail[prio];
-    Task* stolen = this->tasks[prio][index % elemNum];
-    this->tail[prio]++;
-    IF_TASK_STATISTICS(statStealNum++);
-    return stolen;
+  // Stealers only compete on the tail. The first CAS wins. The losers simply
+  // return zero and will try another victim. Note that the tail is read before
+  // the head (and the head before the ring) and that x86 does not reorder
+  // loads. We take half of the tasks (rounded up) to never go beyond a task
+  // the owner reserved after the tail we read. The epoch incremented by the
+  // owner invalidates our CAS if we read the head before the reservation
+  uint32 TaskWorkStealingQueue::steal(Task **tasks, uint32 maxNum) {
+    int mask;
+    while ((mask = this->getActiveMask()) != 0) {
+      const uint32 prio = __bsf(mask);
+      const int64 tail = __load_acquire(&this->tail.w[prio]);
+      const int32 head = __load_acquire(&this->head[prio]);
+      const int32 size = int32(uint32(head) - uint32(tail));
+      if (size <= 0) continue;
+      uint32 stolenNum = uint32(size) - uint32(size) / 2;
+      if (stolenNum > maxNum) stolenNum = maxNum;
+      if (stolenNum > PF_TASK_STEAL_MAX) stolenNum = PF_TASK_STEAL_MAX;
+      const TaskRing *ring = __load_acquire(&this->ring[prio]);
+      for (uint32 i = 0; i < stolenNum; ++i)
+        tasks[i] = ring->get(int32(uint32(tail) + i));
+      const uint32 epoch = uint32(uint64(tail) >> 32);
+      const int64 next = makeTail(epoch, int32(uint32(tail) + stolenNum));
+      if (atomic_cmpxchg(&this->tail.w[prio], next, tail) != tail)
+        return 0;
+      IF_TASK_STATISTICS(statStealNum++);
+      IF_TASK_STATISTICS(statStolenNum += stolenNum);
+      return stolenNum;
+    }
+    return 0;
+  }
+
+  TaskAffinityQueue::TaskAffinityQueue(void)
+#if PF_TASK_STATICTICS
+    : statInsertNum(0), statGetNum(0)
+#endif /* PF_TASK_STATICTICS */
+  {
+    for (uint32 i = 0; i < TaskPriority::NUM; ++i)
+      this->stack[i] = this->fifo[i] = NULL;
   }
 
-  // insertion is done by all threads. We use a mutex
-  template<int elemNum>
-  bool TaskAffinityQueue<elemNum>::insert(Task &task) {
+  // insertion is done by all threads. The task is pushed on the stack with a
+  // CAS and only then, the head is incremented. So, the owner always finds the
+  // tasks reported by the active mask in the stack or in its FIFO
+  void TaskAffinityQueue::insert(Task &task) {
     const uint32 prio = task.getPriority();
-    if (UNLIKELY(this->head[prio] - this->tail[prio] == elemNum))
-      return false;
-    Lock<typename TaskQueue<elemNum>::MutexType> lock(this->mutex);
-    if (UNLIKELY(this->head[prio] - this->tail[prio] == elemNum))
-      return false;
     __store_release(&task.state, uint8(TaskState::READY));
-    __store_release(&this->tasks[prio][this->head[prio] % elemNum], &task);
-    const int32 nextHead = this->head[prio] + 1;
-    __store_release(&this->head[prio], nextHead);
+    Task *top;
+    do {
+      top = __load_acquire(&this->stack[prio]);
+      task.next = top;
+    } while (atomic_cmpxchg(&this->stack[prio], &task, top) != top);
+    atomic_add(&this->head[prio], 1);
     IF_TASK_STATISTICS(statInsertNum++);
-    return true;
   }
 
-  // get is only done by the owner that therefore owns the tail. We use proper
-  // store_release / load_acquire to avoid locks
-  template<int elemNum>
-  Task* TaskAffinityQueue<elemNum>::get(void) {
-    if (this->getActiveMask() == 0) return NULL;
+  // get is only done by the owner that therefore owns the tail and the FIFOs.
+  // Since the owner always takes the complete stack, there is no ABA problem
+  Task* TaskAffinityQueue::get(void) {
     const int mask = this->getActiveMask();
+    if (mask == 0) return NULL;
     const uint32 prio = __bsf(mask);
-    Task* task = __load_acquire(&this->tasks[prio][this->tail[prio] % elemNum]);
+    if (this->fifo[prio] == NULL) {
+      Task *top;
+      do top = __load_acquire(&this->stack[prio]);
+      while (atomic_cmpxchg(&this->stack[prio], (Task*) NULL, top) != top);
+      PF_ASSERT(top != NULL);
+      Task *reversed = NULL;
+      while (top) {
+        Task *next = top->next;
+        top->next = reversed;
+        reversed = top;
+        top = next;
+      }
+      this->fifo[prio] = reversed;
+    }
+    Task *task = this->fifo[prio];
+    this->fifo[prio] = task->next;
+    task->next = NULL;
     const int32 nextTail = this->tail[prio] + 1;
     __store_release(&this->tail[prio], nextTail);
     IF_TASK_STATISTICS(statGetNum++);
     return task;
   }
 
-  TaskAllocator::TaskAllocator(uint32 threadNum_) : threadNum(threadNum_) {
-    this->local = PF_NEW_ARRAY(TaskStorage, threadNum);
-    for (size_t i = 0; i < threadNum; ++i) this->local[i].allocator = this;
-    for (size_t i = 0; i < maxHeap; ++i) this->global[i] = NULL;
+  TaskAllocator::TaskAllocator(uint32 threadNum_, size_t chunkSize) :
+    releasedSize(0), globalSize(0), highWater(PF_TASK_MEMORY_HIGH_WATER),
+    memorySize(0),
+    pushNum(0), reclaiming(0), foreignNum(0), threadNum(threadNum_),
+    storageNum(threadNum_ + PF_TASK_FOREIGN_STORAGE_NUM)
+  {
+    this->local = PF_NEW_ARRAY(TaskStorage, storageNum);
+    for (size_t i = 0; i < storageNum; ++i) {
+      this->local[i].allocator = this;
+      this->local[i].id = uint32(i);
+    }
+    TaskStorage::initHeapOfSize();
+    TaskStorage::setChunkSize(chunkSize);
   }
 
   TaskAllocator::~TaskAllocator(void) {
 #if PF_TASK_STATICTICS
-    uint32 chunkNum = 0;
-    for (size_t i = 0; i < threadNum; ++i) {
+    for (size_t i = 0; i < storageNum; ++i)
       this->local[i].printStats();
-      chunkNum += uint32(this->local[i].statNewChunkNum);
+    for (uint32 i = 0; i < maxHeap; ++i) {
+      int64 allocNum = 0, deallocNum = 0, requested = 0;
+      for (size_t j = 0; j < storageNum; ++j) {
+        allocNum += this->local[j].statHeapAllocateNum[i];
+        deallocNum += this->local[j].statHeapDeallocateNum[i];
+        requested += this->local[j].statHeapRequested[i];
+      }
+      if (allocNum == 0) continue;
+      const double used = double(allocNum) * TaskStorage::heapSize[i];
+      std::cout << "heap " << TaskStorage::heapSize[i] << "B"
+                << ", allocateNum " << allocNum
+                << ", liveNum " << allocNum - deallocNum
+                << ", internal waste " << 100. * (1. - requested / used)
+                << "%" << std::endl;
     }
     std::cout << "Total Memory for Tasks: "
-              << double(chunkNum * TaskStorage::chunkSize) / 1024
+              << double(this->getMemory()) / 1024
               << "KB" << std::endl;
 #endif /* PF_TASK_STATICTICS */
-    int64 allocateNum = 0;
-    for (size_t i = 0; i < threadNum; ++i)
-      allocateNum += this->local[i].allocateNum;
-    //FATAL_IF (allocateNum < 0, "** You may have deleted a task twice **");
-    //FATAL_IF (allocateNum > 0, "** You may still hold a reference on a task **");
+    // The owner of a chunk counts the tasks other threads freed for it
+    for (size_t i = 0; i < storageNum; ++i) {
+      TaskStorage &storage = this->local[i];
+      storage.flushRemote();
+      const int64 liveNum = storage.allocateNum - storage.remoteNum;
+      FATAL_IF (liveNum < 0, "** You may have deleted a task twice **");
+      FATAL_IF (liveNum > 0, "** You may still hold a reference on a task **");
+    }
     PF_DELETE_ARRAY(this->local);
   }
 
   void *TaskAllocator::allocate(size_t sz) {
-    FATAL_IF (sz > maxSize, "Task size is too large (TODO remove that)");
     // We use free list for the task. Each free list node can be made of:
     // [pointer_to_next_node,pointer_to_next_chunk,sizeof(chunk)]
     // We therefore need three times the size of a pointer for the nodes
     // and therefore for the task
     if (sz < 3 * sizeof(void*)) sz = 3 * sizeof(void*);
-    return this->local[TaskScheduler::threadID].allocate(sz);
+    const uint32 id = TaskScheduler::threadID;
+    if (UNLIKELY(id >= this->threadNum)) return this->allocateForeign(sz);
+    TaskStorage &storage = this->local[id];
+    if (UNLIKELY(sz > maxSize)) return storage.allocateHuge(sz);
+    return storage.allocate(sz, TaskStorage::getHeapID(sz));
   }
 
+  // Same rounding as allocate. Huge tasks are not rounded
+  size_t TaskAllocator::getSizeClass(size_t sz) {
+    if (sz < 3 * sizeof(void*)) sz = 3 * sizeof(void*);
+    if (sz > maxSize) return sz;
+    return TaskStorage::heapSize[TaskStorage::getHeapID(sz)];
+  }
+
+  /*! Storage of the calling foreign thread (PF_TASK_FOREIGN_STORAGE_NUM when
+   *  the thread did not allocate anything yet)
+   */
+  static THREAD uint32 foreignStorage = PF_TASK_FOREIGN_STORAGE_NUM;
+
+  // A foreign thread always uses the same storage and is the owner of the
+  // tasks it allocates while it holds the storage lock
+  void *TaskAllocator::allocateForeign(size_t sz) {
+    if (UNLIKELY(foreignStorage >= PF_TASK_FOREIGN_STORAGE_NUM))
+      foreignStorage = uint32(this->foreignNum++) % PF_TASK_FOREIGN_STORAGE_NUM;
+    TaskStorage &storage = this->local[this->threadNum + foreignStorage];
+    Lock<MutexActive> lock(storage.mutex);
+    if (UNLIKELY(sz > maxSize)) return storage.allocateHuge(sz);
+    return storage.allocate(sz, TaskStorage::getHeapID(sz));
+  }
+
+  // Foreign threads never touch the local heaps. Their tasks go back to the
+  // owners through the remote lists
   void TaskAllocator::deallocate(void *ptr) {
-    return this->local[TaskScheduler::threadID].deallocate(ptr);
+    const uint32 id = TaskScheduler::threadID;
+    if (UNLIKELY(id >= this->threadNum)) {
+      TaskChunk *header = TaskStorage::getChunk(ptr);
+      this->local[header->owner].pushRemote(ptr);
+      return;
+    }
+    this->local[id].deallocate(ptr);
+  }
+
+  void *TaskAllocator::getReleasedChunk(uint32 chunkID) {
+    std::vector<void*> &chunks = this->released[TaskStorage::getChunkClass(chunkID)];
+    Lock<MutexActive> lock(this->mutex);
+    if (chunks.empty()) return NULL;
+    void *chunk = chunks.back();
+    chunks.pop_back();
+    this->releasedSize -= TaskStorage::getChunkBytes(chunkID);
+    return chunk;
+  }
+
+  size_t TaskAllocator::getMemory(void) const {
+    Lock<MutexActive> lock(const_cast<MutexActive&>(this->mutex));
+    return size_t(this->memorySize) - this->releasedSize;
+  }
+
+  // Size classes are spaced by about a quarter of their size such that the
+  // internal waste stays low. Small ones are chosen to fill a 4KB chunk minus
+  // its header and big ones to make a chunk of whole pages. Above 1KB, the
+  // classes only pack well with bigger chunks: with 4KB chunks, a task above
+  // 2032 bytes is alone in its chunk whatever its class. Beyond one page, a
+  // task takes whole pages anyway so the classes go page by page up to 10
+  // pages and then by a quarter
+  const uint32 TaskStorage::heapSize[TaskStorage::maxHeap] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 496,
+    576, 672, 816, 1008, 1248, 1360, 1696, 2032, 2528, 3152, 3936, 4080,
+    8176, 12272, 16368, 20464, 24560, 28656, 32752, 36848, 40944, 49136, 57328, 65520
+  };
+  uint8 TaskStorage::heapOfSize[TaskStorage::maxLookupSize / 16 + 1];
+  uintptr_t TaskStorage::chunkSize = PF_TASK_CHUNK_SIZE;
+  uint32 TaskStorage::smallHeapNum = 0;
+
+  void TaskStorage::initHeapOfSize(void) {
+    uint32 chunkID = 0;
+    for (uint32 i = 0; i <= maxLookupSize / 16; ++i) {
+      while (heapSize[chunkID] < 16 * i) ++chunkID;
+      heapOfSize[i] = uint8(chunkID);
+    }
+  }
+
+  void TaskStorage::setChunkSize(size_t size) {
+    chunkSize = size;
+    smallHeapNum = 0;
+    while (smallHeapNum < maxHeap && heapSize[smallHeapNum] <= size - headerSize)
+      smallHeapNum++;
+  }
+
+  // Chunk sizes are multiple of chunkSize so the chunks remain aligned. The
+  // end of a region is lost when the chunk does not fit. Only the regions ask
+  // for huge pages: the other mappings (like the fiber stacks) are too small
+  void *TaskStorage::cutChunk(size_t bytes) {
+    if (size_t(this->regionEnd - this->regionCurr) < bytes) {
+      this->regionCurr = (char *) mapPages(regionSize, regionSize);
+      adviseHugePages(this->regionCurr, regionSize);
+      if (this->node >= 0) bindPages(this->regionCurr, regionSize, this->node);
+      this->regionEnd = this->regionCurr + regionSize;
+      this->regions.push_back(this->regionCurr);
+    }
+    void *chunk = this->regionCurr;
+    this->regionCurr += bytes;
+    return chunk;
   }
 
   void TaskStorage::newChunk(uint32 chunkID) {
-    IF_TASK_STATISTICS(statNewChunkNum++);
     // We store the size of the elements in the chunk header
-    const uint32 elemSize = 1 << chunkID;
-    char *chunk = (char *) PF_ALIGNED_MALLOC(chunkSize, chunkSize);
-
-    // We store this pointer to free it later while deleting the task
-    // allocator
-    this->toFree.push_back(chunk);
-    *(uint32 *) chunk = elemSize;
+    const uint32 elemSize = heapSize[chunkID];
+    const size_t chunkBytes = getChunkBytes(chunkID);
+    char *chunk = (char *) allocator->getReleasedChunk(chunkID);
+    if (chunk == NULL) {
+      IF_TASK_STATISTICS(statNewChunkNum++);
+      chunk = (char *) this->cutChunk(chunkBytes);
+      allocator->memorySize += chunkBytes;
+    }
+    TaskChunk *header = (TaskChunk *) chunk;
+    header->elemSize = elemSize;
+    header->chunkID = uint16(chunkID);
+    header->elemNum = uint16((chunkBytes - headerSize) / elemSize);
+    header->owner = this->id;
 
     // Fill the free list here
     this->currSize[chunkID] = elemSize;
-    char *data = (char*) chunk + CACHE_LINE;
-    const char *end = (char*) chunk + chunkSize;
+    char *data = (char*) chunk + headerSize;
+    const char *end = (char*) chunk + chunkBytes;
     *(void**) data = NULL; // Last element of the list is the first in chunk
     void *pred = data;
     data += elemSize;
@@ -516,8 +1257,39 @@ namespace pf
     this->chunk[chunkID] = pred;
   }
 
+  // Huge tasks are rare enough to directly go to the system. The header
+  // tells deallocate that the chunk is not pooled
+  void *TaskStorage::allocateHuge(size_t sz) {
+    if (this->remote) this->popRemote();
+    const size_t chunkBytes = headerSize + sz;
+    TaskChunk *header = (TaskChunk *) PF_ALIGNED_MALLOC(chunkBytes, chunkSize);
+    header->elemSize = uint32(sz);
+    header->chunkID = uint16(maxHeap);
+    header->elemNum = 0;
+    header->owner = this->id;
+    allocator->memorySize += chunkBytes;
+    this->allocateNum++;
+    return (char *) header + headerSize;
+  }
+
+  TaskFiber::TaskFiber(void) :
+    fiber((fiber_func) TaskFiber::main, this, PF_TASK_FIBER_STACK_SIZE),
+    caller(NULL), task(NULL), nextToRun(NULL), next(NULL), suspended(false) {}
+
+  // Nothing here depends on the thread we run on: the fiber may have moved to
+  // another thread while the task was suspended
+  void TaskFiber::main(TaskFiber *fiber) {
+    for (;;) {
+      fiber->nextToRun = fiber->task->run();
+      fiber->fiber.switchTo(*fiber->caller);
+    }
+  }
+
   TaskThread::TaskThread(void) :
-    state(TASK_THREAD_STATE_RUNNING), victim(0), toWakeUp(0)
+    state(TASK_THREAD_STATE_RUNNING), victim(0), toWakeUp(0),
+    scheduledNum(0), doneNum(0), threadFiber(NULL), freeFibers(NULL),
+    currentFiber(NULL), runningTask(NULL), toUnlock(NULL), toInject(NULL),
+    runSomethingDepth(0), waitDepth(0), freeTimers(NULL), timerCheck(1)
 #if PF_TASK_STATICTICS
     , sleepNum(0u)
 #endif /* PF_TASK_STATICTICS */
@@ -527,71 +1299,150 @@ namespace pf
 #if PF_TASK_STATICTICS
     std::cout << "Thread " << threadID << " sleepNum: " << sleepNum << std::endl;
 #endif /* PF_TASK_STATICTICS */
+    while (this->freeFibers) {
+      TaskFiber *next = this->freeFibers->next;
+      PF_DELETE(this->freeFibers);
+      this->freeFibers = next;
+    }
+    PF_SAFE_DELETE(this->threadFiber);
+    while (this->freeTimers) {
+      TaskTimer *next = this->freeTimers->next;
+      PF_DELETE(this->freeTimers);
+      this->freeTimers = next;
+    }
+  }
+
+  // The main thread built everything so the pages of the thread state are
+  // moved while the rings are simply allocated again. Our stack is already
+  // local since we are the first to touch it (and we are already pinned)
+  void TaskThread::moveToNode(void) {
+    bindPages(this, sizeof(TaskThread), int(this->node));
+    this->wsQueue.renewRings();
+  }
+
+  TaskTimer *TaskThread::newTimer(void) {
+    TaskTimer *timer = this->freeTimers;
+    if (timer == NULL) return PF_NEW(TaskTimer);
+    this->freeTimers = timer->next;
+    return timer;
   }
 
-  void TaskThread::sleep(void) {
-    Lock<MutexSys> lock(mutex);
+  void TaskThread::deleteTimer(TaskTimer *timer) {
+    timer->next = this->freeTimers;
+    this->freeTimers = timer;
+  }
 
-    // Double check that we did not get anything to run in the mean time
-    // Note that we always go to sleep if the system is locked
-    if (afQueue.getActiveMask() && !scheduler->locked) return;
-    if (state == TASK_THREAD_STATE_DEAD) return;
+  TaskFiber *TaskThread::newFiber(void) {
+    TaskFiber *fiber = this->freeFibers;
+    if (fiber == NULL) return PF_NEW(TaskFiber);
+    this->freeFibers = fiber->next;
+    return fiber;
+  }
+
+  void TaskThread::deleteFiber(TaskFiber *fiber) {
+    fiber->next = this->freeFibers;
+    this->freeFibers = fiber;
+  }
 
+  Fiber *TaskThread::getCurrentContext(void) {
+    if (this->currentFiber) return &this->currentFiber->fiber;
+    if (UNLIKELY(this->threadFiber == NULL)) this->threadFiber = PF_NEW(Fiber);
+    return this->threadFiber;
+  }
+
+  // There is no lock here. The thread announces that it sleeps with a CAS
+  // on its state and then registers itself in the sleeping bitfield. Wakers
+  // move the state to WOKEN_UP with a CAS and go to the kernel only if they
+  // succeeded
+  bool TaskThread::sleep(bool canSpin) {
     // Previous state is not necessarily RUNNING. It can be "OUTSIDE"
-    const TaskThreadState prevState = state;
-    state = TASK_THREAD_STATE_SLEEPING;
+    const int32 prevState = state;
+    if (prevState == TASK_THREAD_STATE_DEAD) return false;
+
+    // Nothing to run. This is the time to take back our tasks freed by the
+    // other threads such that the reclaimer may release them
+    if (allocator && !scheduler->locked)
+      allocator->local[this->threadID].popRemote();
+    if (atomic_cmpxchg(&state, TASK_THREAD_STATE_SLEEPING, prevState) != prevState)
+      return false;
 
     // *Globally* indicate that we are now sleeping
     TASK_PROFILE(scheduler->profiler, onSleep, (uint32) threadID);
-    scheduler->sleepMutex.lock();
-    scheduler->sleeping |= (size_t(1u) << this->threadID);
-    scheduler->sleepingNum++;
-    scheduler->sleepMutex.unlock();
+    scheduler->sleeping.set(uint32(this->threadID));
+    atomic_add(&scheduler->sleepingNum, 1);
     IF_TASK_STATISTICS(this->sleepNum++);
-    while (state == TASK_THREAD_STATE_SLEEPING)
-      cond.wait(mutex);
-
-    // We are not sleeping anymore. Return to our previous state
-    scheduler->sleepMutex.lock();
-    scheduler->sleepingNum--;
-    scheduler->sleeping &= ~(size_t(1u) << this->threadID);
-    scheduler->sleepMutex.unlock();
 
-    // We got killed
-    if (state == TASK_THREAD_STATE_DEAD) return;
-    state = prevState;
+    // We may be the last thread that ran a task while main waits for all of
+    // them. Since we are registered, main cannot miss this check
+    scheduler->checkWaitAll();
+
+    // Double check that we did not get anything to run in the mean time. Note
+    // that we always go to sleep if the system is locked. The occupancy bitmap
+    // may also miss a task pushed while the bit of its queue was being cleared.
+    // The atomic add above orders our registration before these loads (see
+    // wakeUpOne for the other side)
+    if (!scheduler->locked)
+      if (afQueue.getActiveMask() || scheduler->hasStealableTasks())
+        atomic_cmpxchg(&state, prevState, TASK_THREAD_STATE_SLEEPING);
+
+    // One sleeping thread wakes up by itself at the next timer deadline
+    const int64 timeoutUs = scheduler->keepTime(uint32(this->threadID));
+    while (state == TASK_THREAD_STATE_SLEEPING) {
+      futex.wait(&state, TASK_THREAD_STATE_SLEEPING, timeoutUs);
+      if (timeoutUs < 0) continue;
+      atomic_cmpxchg(&state, prevState, TASK_THREAD_STATE_SLEEPING);
+      break;
+    }
+    if (timeoutUs >= 0) scheduler->releaseTime(uint32(this->threadID));
+    this->timerCheck = 1; // We do not know what time it is
+
+    // We are not sleeping anymore
+    atomic_add(&scheduler->sleepingNum, -1);
+    scheduler->sleeping.clear(uint32(this->threadID));
+
+    // Return to our previous state unless we got killed. If somebody woke us
+    // up, we are a spinning thief now
+    const bool wokenUp = atomic_cmpxchg(&state, prevState,
+      TASK_THREAD_STATE_WOKEN_UP) == TASK_THREAD_STATE_WOKEN_UP;
+    if (wokenUp && !canSpin) atomic_add(&scheduler->spinningNum, -1);
+    return wokenUp && canSpin;
   }
 
-  void TaskThread::wakeUp(int32 threadThatWakesMeUp) {
-    Lock<MutexSys> lock(mutex);
-    if (state == TASK_THREAD_STATE_SLEEPING) {
+  // We count the thread as spinning before it can run. Therefore, the other
+  // producers do not wake up anyone else in the mean time
+  bool TaskThread::wakeUp(int32 threadThatWakesMeUp) {
+    atomic_add(&scheduler->spinningNum, 1);
+    if (atomic_cmpxchg(&state, TASK_THREAD_STATE_WOKEN_UP, TASK_THREAD_STATE_SLEEPING)
+        == TASK_THREAD_STATE_SLEEPING) {
       TASK_PROFILE(scheduler->profiler, onWakeUp, (uint32) threadID);
       if (threadThatWakesMeUp >= 0)
         victim = threadThatWakesMeUp;
-      state = TASK_THREAD_STATE_RUNNING;
-      cond.broadcast();
+      futex.wakeUp(&state);
+      return true;
     }
+    atomic_add(&scheduler->spinningNum, -1);
+    return false;
   }
 
-  void TaskThread::tryWakeUp(int32 threadThatWakesMeUp) {
-    if (state != TASK_THREAD_STATE_SLEEPING) return;
-    this->wakeUp(threadThatWakesMeUp);
+  bool TaskThread::tryWakeUp(int32 threadThatWakesMeUp) {
+    if (state != TASK_THREAD_STATE_SLEEPING) return false;
+    return this->wakeUp(threadThatWakesMeUp);
   }
 
   void TaskThread::die(void) {
-    Lock<MutexSys> lock(mutex);
-    state = TASK_THREAD_STATE_DEAD;
-    cond.broadcast();
+    __store_release(&state, int32(TASK_THREAD_STATE_DEAD));
+    futex.wakeUp(&state);
   }
 
   void TaskStorage::pushGlobal(uint32 chunkID) {
     IF_TASK_STATISTICS(statPushGlobalNum++);
 
-    const uint32 elemSize = 1 << chunkID;
+    const uint32 elemSize = heapSize[chunkID];
     void *list = this->chunk[chunkID];
     void *succ = list, *pred = NULL;
     uintptr_t totalSize = 0;
-    while (this->currSize[chunkID] > chunkSize) {
+    const uint32 batchSize = getBatchSize(chunkID);
+    while (this->currSize[chunkID] > batchSize) {
       assert(succ);
       pred = succ;
       succ = *(void**) succ;
@@ -603,25 +1454,21 @@ namespace pf
     if (pred) {
       *(void**) pred = NULL;
       this->chunk[chunkID] = succ;
-      Lock<MutexActive> lock(allocator->mutex);
-      ((void**) list)[1] = allocator->global[chunkID];
       ((uintptr_t *) list)[2] = totalSize;
-      allocator->global[chunkID] = list;
+      // Count it first such that globalSize never goes below zero
+      allocator->globalSize += totalSize;
+      this->global[chunkID].push(list);
+      allocator->pushNum++;
+      allocator->reclaimIfNeeded();
     }
   }
 
   void TaskStorage::popGlobal(uint32 chunkID) {
-    void *list = NULL;
     assert(this->chunk[chunkID] == NULL);
-    if (allocator->global[chunkID] == NULL) return;
-
-    // Limit the contention time
-    do {
-      Lock<MutexActive> lock(allocator->mutex);
-      list = allocator->global[chunkID];
-      if (list == NULL) return;
-      allocator->global[chunkID] = ((void**) list)[1];
-    } while (0);
+    if (this->global[chunkID].empty()) return;
+    void *list = this->global[chunkID].pop();
+    if (list == NULL) return;
+    allocator->globalSize += -atomic_t(((uintptr_t *) list)[2]);
 
     // This is our new chunk
     this->chunk[chunkID] = list;
@@ -629,27 +1476,103 @@ namespace pf
     IF_TASK_STATISTICS(statPopGlobalNum++);
   }
 
-  void* TaskStorage::allocate(size_t sz) {
+  void* TaskStorage::allocate(size_t sz, uint32 chunkID) {
     IF_TASK_STATISTICS(statAllocateNum++);
-    const uint32 chunkID = __bsf(int(nextHighestPowerOf2(uint32(sz))));
+    IF_TASK_STATISTICS(statHeapAllocateNum[chunkID]++);
+    IF_TASK_STATISTICS(statHeapRequested[chunkID] += sz);
     if (UNLIKELY(this->chunk[chunkID] == NULL)) {
-      this->popGlobal(chunkID);
+      if (this->remote) this->popRemote();
+      if (this->chunk[chunkID] == NULL) this->popGlobal(chunkID);
       if (UNLIKELY(this->chunk[chunkID] == NULL))
         this->newChunk(chunkID);
     }
     void *curr = this->chunk[chunkID];
     this->chunk[chunkID] = *(void**) curr; // points to its predecessor
-    this->currSize[chunkID] -= 1 << chunkID;
+    this->currSize[chunkID] -= heapSize[chunkID];
     this->allocateNum++;
     return curr;
   }
 
   void TaskStorage::deallocate(void *ptr) {
     IF_TASK_STATISTICS(statDeallocateNum++);
-    // Figure out with the chunk header the size of this element
-    char *chunk = (char*) (uintptr_t(ptr) & ~((1<<logChunkSize)-1));
-    const uint32 elemSize = *(uint32*) chunk;
-    const uint32 chunkID = __bsf(int(nextHighestPowerOf2(uint32(elemSize))));
+    // Figure out with the chunk header who owns this element
+    TaskChunk *header = getChunk(ptr);
+    IF_TASK_STATISTICS(if (header->elemNum) statHeapDeallocateNum[header->chunkID]++);
+    if (LIKELY(header->owner == this->id)) {
+      this->freeLocal(ptr, header);
+      this->allocateNum--;
+    } else
+      allocator->local[header->owner].pushRemote(ptr);
+  }
+
+  void TaskStorage::pushRemote(void *ptr) {
+    for (;;) {
+      void *head = __load_acquire(&this->remote);
+      *(void**) ptr = head;
+      if (atomic_cmpxchg(&this->remote, ptr, head) == head) break;
+    }
+    this->remoteNum++;
+  }
+
+  // Consumers take the whole list at once so there is no ABA issue here
+  void *TaskStorage::takeRemote(void) {
+    void *list;
+    do {
+      list = __load_acquire(&this->remote);
+      if (list == NULL) return NULL;
+    } while (atomic_cmpxchg(&this->remote, (void*) NULL, list) != list);
+    return list;
+  }
+
+  void TaskStorage::popRemote(void) {
+    void *list = this->takeRemote();
+    while (list) {
+      void *next = *(void**) list;
+      this->freeLocal(list, getChunk(list));
+      list = next;
+    }
+  }
+
+  // The tasks are linked per heap and each list directly goes to our global
+  // heap. We do not touch the local heaps since we may not be the owner
+  void TaskStorage::flushRemote(void) {
+    void *list = this->takeRemote();
+    void *heads[maxHeap];
+    uintptr_t sizes[maxHeap];
+    for (uint32 i = 0; i < maxHeap; ++i) {
+      heads[i] = NULL;
+      sizes[i] = 0;
+    }
+    while (list) {
+      void *next = *(void**) list;
+      TaskChunk *header = getChunk(list);
+      if (UNLIKELY(header->elemNum == 0)) {
+        allocator->memorySize += -atomic_t(headerSize + header->elemSize);
+        PF_ALIGNED_FREE(header);
+      } else {
+        const uint32 chunkID = header->chunkID;
+        *(void**) list = heads[chunkID];
+        heads[chunkID] = list;
+        sizes[chunkID] += header->elemSize;
+      }
+      list = next;
+    }
+    for (uint32 i = 0; i < maxHeap; ++i) {
+      if (heads[i] == NULL) continue;
+      ((uintptr_t *) heads[i])[2] = sizes[i];
+      allocator->globalSize += sizes[i];
+      this->global[i].push(heads[i]);
+    }
+  }
+
+  void TaskStorage::freeLocal(void *ptr, TaskChunk *header) {
+    const uint32 elemSize = header->elemSize;
+    if (UNLIKELY(header->elemNum == 0)) {
+      allocator->memorySize += -atomic_t(headerSize + elemSize);
+      PF_ALIGNED_FREE(header);
+      return;
+    }
+    const uint32 chunkID = header->chunkID;
 
     // Insert the free element in the free list
     void *succ = this->chunk[chunkID];
@@ -658,9 +1581,8 @@ namespace pf
     this->currSize[chunkID] += elemSize;
 
     // If this thread has too many free tasks, we give some to the global heap
-    if (this->currSize[chunkID] > 2 * chunkSize)
+    if (this->currSize[chunkID] > 2 * getBatchSize(chunkID))
       this->pushGlobal(chunkID);
-    this->allocateNum--;
   }
 
   void TaskScheduler::threadFunction(TaskScheduler::ThreadStartup *threadData)
@@ -668,12 +1590,16 @@ namespace pf
     threadID = uint32(threadData->tid);
     TaskScheduler *This = &threadData->scheduler;
     TaskThread &myself = This->taskThread[threadID];
-    const int maxInactivityNum = (This->getWorkerNum()+1) * PF_TASK_TRIES_BEFORE_YIELD;
+    const int maxInactivityNum = PF_TASK_TRIES_BEFORE_YIELD;
     int inactivityNum = 0;
+    bool spinning = false; // True when we look for tasks to steal
 
     // We do not need it anymore
     PF_DELETE(threadData);
 
+    // Our state and our queues go to our node
+    if (This->bindMemory) myself.moveToNode();
+
     // flush to zero and no denormals
     _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
 
@@ -682,38 +1608,112 @@ namespace pf
     for (;;) {
       Task *task = This->getTask();
       if (task) {
+        // We were the last one looking for tasks. Since there may be more
+        // tasks to steal, somebody else has to take over
+        if (spinning) {
+          spinning = false;
+          if (atomic_add(&This->spinningNum, -1) == 1 && !This->occupied.empty())
+            This->wakeUpOne();
+        }
         This->runTask(task);
         inactivityNum = 0;
-      } else
-        inactivityNum++; 
+      } else {
+        if (!spinning) {
+          spinning = true;
+          atomic_add(&This->spinningNum, 1);
+        }
+        inactivityNum++;
+      }
       if (UNLIKELY(myself.state == TASK_THREAD_STATE_DEAD)) break;
       if (UNLIKELY(inactivityNum >= maxInactivityNum)) {
         inactivityNum = 0;
-        myself.sleep();
+        if (spinning) atomic_add(&This->spinningNum, -1);
+        spinning = myself.sleep(true);
+      }
+      if (UNLIKELY(This->locked)) {
+        if (spinning) atomic_add(&This->spinningNum, -1);
+        spinning = false;
+        while (UNLIKELY(This->locked)) myself.sleep();
       }
-      while (UNLIKELY(This->locked))
-        myself.sleep();
     }
+    if (spinning) atomic_add(&This->spinningNum, -1);
+    // Only the thread itself can release its thread fiber (see Fiber)
+    PF_SAFE_DELETE(myself.threadFiber);
+    myself.threadFiber = NULL;
+  }
+
+  /*! Current time in micro-seconds */
+  static INLINE uint64 getTimerUs(void) { return uint64(getSeconds() * 1e6); }
+
+  /*! Current time in timer ticks */
+  static INLINE uint64 getTimerTick(void) {
+    return getTimerUs() / PF_TASK_TIMER_TICK_US;
   }
 
-  TaskScheduler::TaskScheduler(int workerNum_) :
+  /*! We have a work queue for the main thread too */
+  static uint32 getQueueNum(int workerNum) {
+    if (workerNum < 0) workerNum = getNumberOfLogicalThreads() - 1;
+    return uint32(workerNum + 1);
+  }
+
+  TaskScheduler::TaskScheduler(int workerNum_, uint32 nodeNum_) :
     taskThread(NULL),
 #if PF_TASK_PROFILER
     profiler(NULL),
 #endif /* PF_TASK_PROFILER */      
-    sleeping(0u), sleepingNum(0), locked(0)
+    workerNum(getQueueNum(workerNum_) - 1),
+    queueNum(getQueueNum(workerNum_)),
+    sleeping(queueNum), sleepingNum(0), spinningNum(0), wakeUpAlways(false),
+    waitingAll(0), occupied(queueNum), nodeNum(1), nodeMask(NULL),
+    stealNum(NULL), stealStride(0), bindMemory(false),
+#if PF_TASK_IO
+    reactor(NULL),
+#endif /* PF_TASK_IO */
+    foreignNum(0), injectedNum(0), injected(NULL),
+    timers(getTimerTick()), timerNum(0),
+    nextTimerTick(~0ull >> 1), timeKeeper(-1), timeKeeperTick(0), locked(0)
   {
-    if (workerNum_ < 0) workerNum_ = getNumberOfLogicalThreads() - 1;
-    this->workerNum = workerNum_;
-
-    // We have a work queue for the main thread too
-    this->queueNum = workerNum+1;
+    threadID = PF_TASK_MAIN_THREAD; // The main thread starts the system
     this->taskThread = PF_NEW_ARRAY(TaskThread, queueNum);
     this->taskThread[PF_TASK_MAIN_THREAD].thread = NULL;
     this->taskThread[PF_TASK_MAIN_THREAD].scheduler = this;
     this->taskThread[PF_TASK_MAIN_THREAD].threadID = 0;
     this->taskThread[PF_TASK_MAIN_THREAD].state = TASK_THREAD_STATE_OUTSIDE;
 
+    // A simulated topology puts consecutive threads on the same node.
+    // Otherwise, the node of a thread is the one of the logical thread its
+    // affinity pins it to (the main thread is not pinned but is counted as
+    // affinity 0)
+    const int32 systemNodeNum = getNumberOfNumaNodes();
+    if (nodeNum_ == 0) {
+      this->nodeNum = uint32(systemNodeNum);
+      this->bindMemory = systemNodeNum > 1;
+      for (size_t i = 0; i < queueNum; ++i) {
+        const int thread = getLogicalThreadOfAffinity(int(i));
+        const int node = thread >= 0 ? getNumaNodeOfLogicalThread(thread) : 0;
+        this->taskThread[i].node = uint32(node);
+      }
+    } else {
+      this->nodeNum = nodeNum_ < queueNum ? nodeNum_ : uint32(queueNum);
+      for (size_t i = 0; i < queueNum; ++i)
+        this->taskThread[i].node = uint32(i * this->nodeNum / queueNum);
+    }
+    const uint32 wordNum = this->occupied.getWordNum();
+    const size_t maskSize = this->nodeNum * wordNum * sizeof(size_t);
+    this->nodeMask = (size_t *) PF_ALIGNED_MALLOC(maskSize, CACHE_LINE);
+    std::memset(this->nodeMask, 0, maskSize);
+    for (size_t i = 0; i < queueNum; ++i) {
+      size_t *mask = this->nodeMask + this->taskThread[i].node * wordNum;
+      mask[i / Bitmap::bitsPerWord] |= size_t(1) << (i % Bitmap::bitsPerWord);
+    }
+
+    // Each thief only writes its own cache lines
+    const uint32 perLine = CACHE_LINE / sizeof(uint64);
+    this->stealStride = (this->nodeNum + perLine - 1) / perLine * perLine;
+    const size_t stealSize = queueNum * this->stealStride * sizeof(uint64);
+    this->stealNum = (uint64 *) PF_ALIGNED_MALLOC(stealSize, CACHE_LINE);
+    std::memset(this->stealNum, 0, stealSize);
+
     // Only if we have dedicated worker threads
     if (workerNum > 0) {
       const size_t stackSize = 4*MB;
@@ -721,37 +1721,51 @@ namespace pf
         const int affinity = int(i+1);
         ThreadStartup *threadData = PF_NEW(ThreadStartup,i+1,*this);
         this->taskThread[i+1].scheduler = this;
-        this->taskThread[i+1].thread = createThread((pf::thread_func) threadFunction, threadData, stackSize, affinity);
         this->taskThread[i+1].threadID = i+1;
+        this->taskThread[i+1].thread = createThread((pf::thread_func) threadFunction, threadData, stackSize, affinity);
       }
     }
+#if PF_TASK_IO
+    this->reactor = PF_NEW(TaskReactor, *this);
+#endif /* PF_TASK_IO */
   }
 
   bool TaskScheduler::trySchedule(Task &task) {
     TaskThread &myself = this->taskThread[this->threadID];
+
+    // The task must be counted before anyone can run it
+    __store_release(&myself.scheduledNum, myself.scheduledNum + 1);
+    const bool success = this->tryPush(task);
+    if (UNLIKELY(!success))
+      __store_release(&myself.scheduledNum, myself.scheduledNum - 1);
+    return success;
+  }
+
+  bool TaskScheduler::tryPush(Task &task) {
+    TaskThread &myself = this->taskThread[this->threadID];
     const uint32 affinity = task.getAffinity();
     bool success;
     if (affinity >= this->queueNum) {
       success = myself.wsQueue.insert(task);
-      // Wake up one sleeping thread (if any)
+      // Tell the thieves and wake up one sleeping thread (if any)
       if (success) {
-        // no race condition...
-        const size_t nonVolatileSleeping = this->sleeping;
-        if (UNLIKELY(nonVolatileSleeping)) {
-          const size_t sleepingID = __bsf(nonVolatileSleeping);
-          assert(sleepingID < this->queueNum);
-          this->taskThread[sleepingID].tryWakeUp(threadID);
-        }
+        this->setOccupied(this->threadID);
+        this->wakeUpOne();
       }
     } else {
-      success = this->taskThread[affinity].afQueue.insert(task);
-      // We really have to wake up this thread if not running
-      if (success) this->taskThread[affinity].wakeUp();
+      this->taskThread[affinity].afQueue.insert(task);
+      // We really have to wake up this thread if sleeping
+      this->taskThread[affinity].tryWakeUp();
+      success = true;
     }
     return success;
   }
 
   void TaskScheduler::schedule(Task &task) {
+    if (UNLIKELY(this->isForeign())) {
+      this->scheduleForeign(task);
+      return;
+    }
     // We pick up any tasks to make some free space for the task we are
     // scheduling
     while (UNLIKELY(!this->trySchedule(task))) {
@@ -769,7 +1783,7 @@ namespace pf
 
     // Everyone goes to sleep except us. Busy waiting is just simpler and
     // locking is anyway super expensive. So, let's do it like this
-    while (this->sleepingNum != this->queueNum - 1) _mm_pause();
+    while (size_t(this->sleepingNum) != this->queueNum - 1) _mm_pause();
 
     // Now we are alone in the world now
     TASK_PROFILE(this->profiler, onLock, threadID);
@@ -790,6 +1804,16 @@ namespace pf
   TaskScheduler::~TaskScheduler(void) {
     for (size_t i = 0; i < workerNum; ++i)
       join(taskThread[i+1].thread); // thread[0] is main
+    // The tasks still waiting for their timers are never run
+    TaskTimer *timer = this->timers.expire(~0ull);
+    while (timer) {
+      TaskTimer *next = timer->next;
+      PF_DELETE(timer);
+      timer = next;
+    }
+#if PF_TASK_IO
+    PF_SAFE_DELETE(this->reactor);
+#endif /* PF_TASK_IO */
 #if PF_TASK_STATICTICS
     for (size_t i = 0; i < queueNum; ++i) {
       std::cout << "Work Stealing Task Queue " << i << " ";
@@ -801,11 +1825,23 @@ namespace pf
     }
 #endif /* PF_TASK_STATICTICS */
     PF_SAFE_DELETE_ARRAY(taskThread);
+    PF_ALIGNED_FREE(nodeMask);
+    PF_ALIGNED_FREE(stealNum);
   }
 
-  THREAD uint32 TaskScheduler::threadID = 0;
+  THREAD uint32 TaskScheduler::threadID = PF_TASK_FOREIGN_THREAD;
 
+  // Reading the clock is not free. A busy thread only looks at the timers
+  // every PF_TASK_TIMER_CHECK calls. A thread that slept (like the time keeper
+  // woken up by its deadline) looks at them right away
   Task* TaskScheduler::getTask() {
+    if (UNLIKELY(this->timerNum != 0)) {
+      TaskThread &myself = this->taskThread[this->threadID];
+      if (--myself.timerCheck == 0) {
+        myself.timerCheck = PF_TASK_TIMER_CHECK;
+        this->fireTimers();
+      }
+    }
     Task *task = NULL;
     int32 afMask = this->taskThread[this->threadID].afQueue.getActiveMask();
     int32 wsMask = this->taskThread[this->threadID].wsQueue.getActiveMask();
@@ -826,15 +1862,165 @@ namespace pf
       }
     }
     if (task == NULL) {
-      // Case 2: try to steal some task from another thread
-      const uint32 victimID = this->taskThread[this->threadID].victim % queueNum;
-      this->taskThread[this->threadID].victim++;
-      return this->taskThread[victimID].wsQueue.steal();
+      // Our own queue is empty. Thieves do not need to look at it anymore
+      this->clearOccupied(this->threadID);
+
+      // Case 2: take the tasks of the foreign threads. Once in our queue, the
+      // other threads can steal them
+      if (UNLIKELY(this->injected != NULL)) {
+        task = this->takeInjected();
+        if (task) return task;
+      }
+
+      // Case 3: try to steal some tasks from another thread. We only look at
+      // the threads that have something to steal, starting from our current
+      // victim to spread the thieves. The threads of our node come first
+      // since their tasks are in our local memory
+      TaskThread &myself = this->taskThread[this->threadID];
+      if (this->occupied.empty()) return NULL;
+      const uint32 from = myself.victim % queueNum;
+      int32 victimID = -1;
+      if (this->nodeNum > 1)
+        victimID = this->findVictim(from, this->getNodeMask(myself.node));
+      if (victimID < 0) victimID = this->findVictim(from, NULL);
+      if (victimID < 0) return NULL;
+      myself.victim = victimID + 1;
+
+      // We run the first task and push the other ones in our own queue. If our
+      // queue is completely full (really unlikely), we simply run them now
+      Task *stolen[PF_TASK_STEAL_MAX];
+      TaskWorkStealingQueue &victimQueue = this->taskThread[victimID].wsQueue;
+      const uint32 stolenNum = victimQueue.steal(stolen, PF_TASK_STEAL_MAX);
+      if (stolenNum == 0) {
+        this->clearOccupied(victimID);
+        return NULL;
+      }
+      this->stealNum[this->threadID * this->stealStride + this->getNode(victimID)]++;
+      for (uint32 i = 1; i < stolenNum; ++i)
+        if (UNLIKELY(!myself.wsQueue.insert(*stolen[i]))) this->runTask(stolen[i]);
+      if (stolenNum > 1) this->setOccupied(this->threadID);
+      return stolen[0];
     }
     return task;
   }
 
+  int32 TaskScheduler::findVictim(uint32 from, const size_t *mask) const {
+    const int32 self = int32(this->threadID);
+    const uint32 next = (this->threadID + 1) % queueNum;
+    int32 victimID = mask ? this->occupied.findNext(from, mask)
+                          : this->occupied.findNext(from);
+    if (victimID == self)
+      victimID = mask ? this->occupied.findNext(next, mask)
+                      : this->occupied.findNext(next);
+    return victimID == self ? -1 : victimID;
+  }
+
+  // Like Go runtime, we only wake up a thread if nobody is already looking for
+  // tasks. A spinning thief that finds something wakes up another thread. The
+  // woken up thread steals from us so we prefer one of our node
+  // A sleeper registers itself and then looks at the queues. We pushed a task
+  // and now look at the sleepers. The work stealing queue publishes the task
+  // with a plain store that the loads below may pass: the fence makes sure
+  // that one of us sees the other
+  void TaskScheduler::wakeUpOne(void) {
+    memoryFence();
+    if (LIKELY(this->spinningNum != 0 && !this->wakeUpAlways)) return;
+    if (this->sleeping.empty()) return;
+    int32 sleepingID = -1;
+    if (this->nodeNum > 1) {
+      const uint32 node = this->taskThread[this->threadID].node;
+      sleepingID = this->sleeping.findNext(0, this->getNodeMask(node));
+    }
+    if (sleepingID < 0) sleepingID = this->sleeping.findFirst();
+    if (sleepingID >= 0) this->taskThread[sleepingID].tryWakeUp(threadID);
+  }
+
+  void TaskScheduler::setOccupied(uint32 id) {
+    if (UNLIKELY(!this->occupied.get(id))) this->occupied.set(id);
+  }
+
+  // Anyone can clear the bit of an empty queue. Since the owner may push a
+  // task while we are clearing it, we check the queue again and set the bit
+  // back if needed. The owner also checks its bit each time it pushes a task.
+  // Finally, threads look at all queues before sleeping
+  void TaskScheduler::clearOccupied(uint32 id) {
+    TaskWorkStealingQueue &queue = this->taskThread[id].wsQueue;
+    if (!this->occupied.get(id) || queue.getActiveMask()) return;
+    this->occupied.clear(id);
+    if (UNLIKELY(queue.getActiveMask())) this->occupied.set(id);
+  }
+
+  // Each thread only updates its own counters. We first read all the done
+  // counters and then all the scheduled ones. Since a task is counted as
+  // scheduled before it can be done, the difference is never smaller than the
+  // number of outstanding tasks at some point between the two passes. Zero is
+  // therefore exact. Only running tasks (or main) can schedule new ones, so it
+  // remains zero
+  // A task waiting for its timer is not counted yet. The timer is released
+  // after the task is scheduled so reading the timer number first is enough
+  bool TaskScheduler::hasOutstandingTasks(void) const {
+    if (__load_acquire(&this->timerNum) != 0) return true;
+    uint32 doneNum = 0, scheduledNum = 0;
+    for (uint32 i = 0; i < this->queueNum; ++i)
+      doneNum += __load_acquire(&this->taskThread[i].doneNum);
+    for (uint32 i = 0; i < this->queueNum; ++i)
+      scheduledNum += __load_acquire(&this->taskThread[i].scheduledNum);
+    scheduledNum += uint32(this->injectedNum);
+    return scheduledNum != doneNum;
+  }
+
+  void TaskScheduler::checkWaitAll(void) {
+    if (UNLIKELY(this->waitingAll) && !this->hasOutstandingTasks())
+      this->taskThread[PF_TASK_MAIN_THREAD].tryWakeUp();
+  }
+
+  bool TaskScheduler::hasStealableTasks(void) {
+    if (this->injected != NULL) return true;
+    for (uint32 i = 0; i < this->queueNum; ++i)
+      if (this->taskThread[i].wsQueue.getActiveMask()) {
+        this->setOccupied(i);
+        return true;
+      }
+    return false;
+  }
+
+  // The event remains locked until we are out of the suspended fiber. So,
+  // nobody can resume it before its context is saved
+  bool TaskScheduler::runInFiber(Task &task, Task *&nextToRun) {
+    TaskThread &myself = this->taskThread[this->threadID];
+    TaskFiber *fiber = task.fiber;
+    if (fiber == NULL) {
+      fiber = myself.newFiber();
+      fiber->task = &task;
+      task.fiber = fiber;
+    }
+    TaskFiber *prevFiber = myself.currentFiber;
+    fiber->caller = myself.getCurrentContext();
+    fiber->suspended = false;
+    myself.currentFiber = fiber;
+    fiber->caller->switchTo(fiber->fiber);
+    myself.currentFiber = prevFiber;
+    const bool suspended = fiber->suspended;
+    if (myself.toUnlock) {
+      myself.toUnlock->unlock();
+      myself.toUnlock = NULL;
+    }
+    if (myself.toInject) {
+      this->inject(*myself.toInject);
+      myself.toInject = NULL;
+      this->wakeUpOne();
+    }
+    if (suspended) return true;
+    nextToRun = fiber->nextToRun;
+    task.fiber = NULL;
+    myself.deleteFiber(fiber);
+    return false;
+  }
+
   void TaskScheduler::runTask(Task *task) {
+    TaskThread &myself = this->taskThread[this->threadID];
+    Task *const prevRunningTask = myself.runningTask;
+
     // Execute the function
     Task *nextToRun = NULL;
     do {
@@ -846,7 +2032,12 @@ namespace pf
 #endif /* NDEBUG */
       __store_release(&task->state, uint8(TaskState::RUNNING));
       TASK_PROFILE(this->profiler, onRunStart, task->name, threadID);
-      nextToRun = task->run();
+      myself.runningTask = task;
+      if (task->suspendable) {
+        // Once suspended, somebody else may already run it. Do not touch it
+        if (this->runInFiber(*task, nextToRun)) break;
+      } else
+        nextToRun = task->run();
       TASK_PROFILE(this->profiler, onRunEnd, task->name, threadID);
       Task *toRelease = task;
 
@@ -893,44 +2084,427 @@ namespace pf
       task = nextToRun;
       if (task) __store_release(&task->state, uint8(TaskState::READY));
     } while (task);
+
+    // The task we picked up from the queues is done now (or suspended, but
+    // then it was counted again when suspended)
+    myself.runningTask = prevRunningTask;
+    __store_release(&myself.doneNum, myself.doneNum + 1);
   }
 
   void TaskScheduler::go(void)
   {
     TaskThread &myself = this->taskThread[PF_TASK_MAIN_THREAD];
     // Be sure that nobody already killed us before we can start
-    myself.mutex.lock();
-    const uint32 state = myself.state;
+    const int32 state = atomic_cmpxchg(&myself.state,
+                                       TASK_THREAD_STATE_RUNNING,
+                                       TASK_THREAD_STATE_OUTSIDE);
     PF_ASSERT(state == TASK_THREAD_STATE_OUTSIDE ||
               state == TASK_THREAD_STATE_DEAD);
 
-    // We were killed, directly exit
-    if (state == TASK_THREAD_STATE_DEAD)
-      myself.mutex.unlock();
     // Nobody killed us. We can enter the tasking system
-    else {
+    if (state == TASK_THREAD_STATE_OUTSIDE) {
       ThreadStartup *thread = PF_NEW(ThreadStartup, PF_TASK_MAIN_THREAD, *this);
-      myself.state = TASK_THREAD_STATE_RUNNING;
-      myself.mutex.unlock();
       threadFunction(thread);
     }
 
     // Properly indicate that we are not in the tasking system anymore
-    myself.mutex.lock();
-    myself.state = TASK_THREAD_STATE_OUTSIDE;
-    myself.mutex.unlock();
+    __store_release(&myself.state, int32(TASK_THREAD_STATE_OUTSIDE));
+  }
+
+  // Like runSomething, the nested waits are bounded since each one runs tasks
+  // on top of our stack. We never run them on the small stack of a fiber
+  bool TaskScheduler::help(void) {
+    TaskThread &myself = taskThread[this->threadID];
+    if (UNLIKELY(myself.currentFiber != NULL)) return false;
+    if (UNLIKELY(myself.waitDepth >= PF_TASK_WAIT_MAX_DEPTH)) return false;
+    Task *task = this->getTask();
+    if (task == NULL) return false;
+    myself.waitDepth++;
+    this->runTask(task);
+    myself.waitDepth--;
+    return true;
+  }
+
+  void TaskScheduler::backOff(uint32 &tryNum) {
+    if (tryNum < PF_TASK_TRIES_BEFORE_YIELD) {
+      tryNum++;
+      _mm_pause();
+    } else
+      yield();
   }
 
+  // Like an event wait except that nobody will resume us: we push ourselves
+  // back once we are out of the fiber (see runInFiber). The thread first runs
+  // its own tasks and any thread may resume us
+  void TaskScheduler::yieldFiber(TaskFiber &fiber) {
+    TaskThread &myself = taskThread[this->threadID];
+    __store_release(&myself.scheduledNum, myself.scheduledNum + 1);
+    fiber.suspended = true;
+    myself.toInject = fiber.task;
+    fiber.fiber.switchTo(*fiber.caller);
+  }
+
+  // Any thread can wait. We help while the task is not done. Since we first
+  // look at our own queue (LIFO), we usually run the children we just spawned
+  // (ie the awaited sub-tree) before anything else. Without any worker, only
+  // we can run the awaited task. A suspendable task does not help since the
+  // tasks would run on its fiber: it gives its thread back until the awaited
+  // task is done
   void TaskScheduler::wait(Ref<Task> task) {
-    TaskThread &myself = taskThread[PF_TASK_MAIN_THREAD];
-    PF_ASSERT(threadID == PF_TASK_MAIN_THREAD);
-    PF_ASSERT(myself.state == TASK_THREAD_STATE_OUTSIDE);
-    if (LIKELY(task)) {
-      while (__load_acquire(&task->state) != TaskState::DONE) {
-        Ref<Task> someTask = this->getTask();
-        if (someTask) this->runTask(someTask);
-        while (UNLIKELY(this->locked)) myself.sleep();
+    if (UNLIKELY(!task)) return;
+    uint32 tryNum = 0;
+    while (__load_acquire(&task->state) != TaskState::DONE) {
+      TaskThread &myself = taskThread[this->threadID]; // May change (fiber)
+      TaskFiber *fiber = myself.currentFiber;
+      if (fiber && myself.runningTask == fiber->task) {
+        this->yieldFiber(*fiber); // We may be on another thread now
+        if (__load_acquire(&task->state) != TaskState::DONE) backOff(tryNum);
+        continue;
       }
+      if (this->help())
+        tryNum = 0;
+      else {
+        FATAL_IF (this->workerNum == 0 && fiber == NULL &&
+                  myself.waitDepth >= PF_TASK_WAIT_MAX_DEPTH,
+                  "too many nested waits without any worker");
+        backOff(tryNum);
+      }
+      while (UNLIKELY(this->locked)) myself.sleep();
+    }
+  }
+
+  // Only a suspendable task waiting from its own run function can be
+  // suspended. The suspended task is counted as a new scheduled one: the event
+  // pushes it back without counting it
+  void TaskScheduler::wait(TaskEvent &event) {
+    if (UNLIKELY(this->isForeign())) {
+      this->waitForeign(event);
+      return;
+    }
+    TaskThread &myself = taskThread[this->threadID];
+    TaskFiber *fiber = myself.currentFiber;
+    if (fiber && myself.runningTask == fiber->task) {
+      event.mutex.lock();
+      if (event.signaled) {
+        event.mutex.unlock();
+        return;
+      }
+      fiber->task->next = event.waiters;
+      event.waiters = fiber->task;
+      __store_release(&myself.scheduledNum, myself.scheduledNum + 1);
+      fiber->suspended = true;
+      myself.toUnlock = &event.mutex;
+      fiber->fiber.switchTo(*fiber->caller);
+      return; // We may be on another thread now
+    }
+
+    // We cannot suspend anything. We help until the event is signaled
+    uint32 tryNum = 0;
+    while (!__load_acquire(&event.signaled)) {
+      if (this->help())
+        tryNum = 0;
+      else
+        backOff(tryNum);
+      while (UNLIKELY(this->locked)) myself.sleep();
+    }
+  }
+
+  // A foreign thread cannot run tasks so it sleeps. It holds foreignMutex
+  // from the test of the event until the wait such that the signal (which
+  // broadcasts with it) cannot be missed
+  void TaskScheduler::waitForeign(TaskEvent &event) {
+    this->foreignMutex.lock();
+    event.mutex.lock();
+    event.foreignNum++;
+    event.mutex.unlock();
+    while (!__load_acquire(&event.signaled))
+      this->foreignCond.wait(this->foreignMutex);
+    event.mutex.lock();
+    event.foreignNum--;
+    event.mutex.unlock();
+    this->foreignMutex.unlock();
+  }
+
+  void TaskScheduler::signalForeign(void) {
+    this->foreignMutex.lock();
+    this->foreignCond.broadcast();
+    this->foreignMutex.unlock();
+  }
+
+  // The depth is per thread. The tasks we run may call it too. Nothing runs
+  // on the small stack of a fiber
+  bool TaskScheduler::runSomething(void) {
+    TaskThread &myself = taskThread[this->threadID];
+    if (UNLIKELY(myself.currentFiber != NULL)) return false;
+    if (UNLIKELY(myself.runSomethingDepth >= PF_TASK_RUN_SOMETHING_MAX_DEPTH))
+      return false;
+    if (UNLIKELY(this->locked)) return false;
+    Task *task = this->getTask();
+    if (task == NULL) return false;
+    myself.runSomethingDepth++;
+    this->runTask(task);
+    myself.runSomethingDepth--;
+    return true;
+  }
+
+  // Affinity queues accept tasks from any thread. We prefer a sleeping worker
+  // and spread the tasks otherwise. Main may be outside the tasking system so
+  // we avoid it when there are workers
+  void TaskScheduler::pushForeign(Task &task) {
+    uint32 id = task.getAffinity();
+    if (id >= this->queueNum) {
+      if (this->workerNum == 0)
+        id = PF_TASK_MAIN_THREAD;
+      else {
+        const int32 sleepingID = this->sleeping.findNext(1);
+        if (sleepingID > 0)
+          id = uint32(sleepingID);
+        else
+          id = 1 + uint32(this->foreignNum++) % uint32(this->workerNum);
+      }
+    }
+    this->taskThread[id].afQueue.insert(task);
+    this->taskThread[id].tryWakeUp();
+  }
+
+  void TaskScheduler::inject(Task &task) {
+    __store_release(&task.state, uint8(TaskState::READY));
+    Task *top;
+    do {
+      top = __load_acquire(&this->injected);
+      task.next = top;
+    } while (atomic_cmpxchg(&this->injected, &task, top) != top);
+  }
+
+  // The task is counted before anyone can run it (see hasOutstandingTasks).
+  // Then, we wake up a thread like wakeUpOne does. Main may be outside the
+  // tasking system so we avoid it when there are workers
+  void TaskScheduler::scheduleForeign(Task &task) {
+    this->injectedNum++;
+    if (task.getAffinity() < this->queueNum) {
+      this->pushForeign(task);
+      return;
+    }
+    this->inject(task);
+    if (this->spinningNum != 0 && !this->wakeUpAlways) return;
+    if (this->sleeping.empty()) return;
+    const int32 sleepingID = this->sleeping.findNext(this->workerNum ? 1 : 0);
+    if (sleepingID > 0 || (sleepingID == 0 && this->workerNum == 0))
+      this->taskThread[sleepingID].tryWakeUp();
+  }
+
+  // Any thread takes the whole stack at once so there is no ABA problem. The
+  // stack is reversed to run the oldest task first. Whatever does not fit in
+  // our queue goes back to the injection queue
+  Task *TaskScheduler::takeInjected(void) {
+    Task *list;
+    do {
+      list = __load_acquire(&this->injected);
+      if (list == NULL) return NULL;
+    } while (atomic_cmpxchg(&this->injected, (Task*) NULL, list) != list);
+    Task *fifo = NULL;
+    while (list) {
+      Task *next = list->next;
+      list->next = fifo;
+      fifo = list;
+      list = next;
+    }
+    Task *first = fifo;
+    fifo = fifo->next;
+    first->next = NULL;
+    if (fifo == NULL) return first;
+    TaskThread &myself = this->taskThread[this->threadID];
+    while (fifo) {
+      Task *next = fifo->next;
+      fifo->next = NULL;
+      if (UNLIKELY(!myself.wsQueue.insert(*fifo))) this->inject(*fifo);
+      fifo = next;
+    }
+    this->setOccupied(this->threadID);
+    this->wakeUpOne();
+    return first;
+  }
+
+#if PF_TASK_IO
+  // Exactly like Task::continueAfter, the task is not ended and referenced
+  // while waiting. It is counted again since the reactor cannot count it
+  void TaskScheduler::waitIO(TaskIO &task) {
+    TaskThread &myself = taskThread[this->threadID];
+    task.toEnd++;
+    task.refInc();
+    __store_release(&myself.scheduledNum, myself.scheduledNum + 1);
+    this->reactor->wait(task);
+  }
+#endif /* PF_TASK_IO */
+
+  /*! size_t is 32 bits wide on i386 */
+  static INLINE uint32 bsf64(uint64 x) {
+    const uint32 lo = uint32(x);
+    if (lo) return uint32(__bsf(int(lo)));
+    return 32 + uint32(__bsf(int(x >> 32)));
+  }
+
+  TaskTimerWheel::TaskTimerWheel(uint64 current) : current(current) {
+    std::memset(this->slots, 0, sizeof(this->slots));
+    std::memset(this->mask, 0, sizeof(this->mask));
+  }
+
+  void TaskTimerWheel::insert(TaskTimer *timer) {
+    if (timer->tick < this->current) timer->tick = this->current;
+    uint32 level = 0;
+    while (level < levelNum - 1 &&
+           ((timer->tick ^ this->current) >> (slotBits * (level + 1))) != 0)
+      level++;
+    const uint32 slot = uint32(timer->tick >> (slotBits * level)) & (slotNum - 1);
+    timer->next = this->slots[level][slot];
+    this->slots[level][slot] = timer;
+    this->mask[level] |= 1ull << slot;
+  }
+
+  // A timer of level l only differs from the current tick in the bits of
+  // level l (and above). The current slot of level 0 may still have timers but
+  // the current slots of the other levels are already cascaded
+  uint64 TaskTimerWheel::getNextTick(void) const {
+    for (uint32 level = 0; level < levelNum; ++level) {
+      const uint32 shift = slotBits * level;
+      const uint32 index = uint32(this->current >> shift) & (slotNum - 1);
+      const uint64 first = level == 0 ? index : index + 1;
+      if (first >= slotNum) continue;
+      const uint64 candidates = this->mask[level] & (~0ull << first);
+      if (candidates == 0) continue;
+      const uint64 slot = bsf64(candidates);
+      const uint32 upper = shift + slotBits;
+      const uint64 base = upper >= 64 ? 0 : (this->current >> upper) << upper;
+      return base | (slot << shift);
+    }
+    return ~0ull;
+  }
+
+  // Redistribute the slots we enter from the highest level down. Therefore,
+  // the current slots of the levels above 0 are always empty
+  void TaskTimerWheel::cascade(void) {
+    for (uint32 level = levelNum - 1; level > 0; --level) {
+      const uint32 shift = slotBits * level;
+      if ((this->current & ((1ull << shift) - 1)) != 0) continue;
+      const uint32 slot = uint32(this->current >> shift) & (slotNum - 1);
+      TaskTimer *timer = this->slots[level][slot];
+      this->slots[level][slot] = NULL;
+      this->mask[level] &= ~(1ull << slot);
+      while (timer) {
+        TaskTimer *succ = timer->next;
+        this->insert(timer);
+        timer = succ;
+      }
+    }
+  }
+
+  // We directly jump to the next tick with some work. We never jump beyond it
+  // (even if now is later) since we could skip slots of the higher levels
+  TaskTimer *TaskTimerWheel::expire(uint64 now) {
+    TaskTimer *expired = NULL;
+    for (;;) {
+      const uint64 next = this->getNextTick();
+      if (next > now || next == ~0ull) break;
+      if (next != this->current) {
+        this->current = next;
+        this->cascade();
+      }
+
+      // Everything in the current slot of level 0 expires now
+      const uint32 slot = uint32(next) & (slotNum - 1);
+      TaskTimer *timer = this->slots[0][slot];
+      this->slots[0][slot] = NULL;
+      this->mask[0] &= ~(1ull << slot);
+      while (timer) {
+        TaskTimer *succ = timer->next;
+        timer->next = expired;
+        expired = timer;
+        timer = succ;
+      }
+      this->current++;
+      this->cascade();
+    }
+    return expired;
+  }
+
+  // We round the deadline up to never start the task too early. Foreign
+  // threads have no timer pool. The thread that fires the timer recycles it in
+  // its own pool anyway
+  void TaskScheduler::addTimer(Task &task, uint32 ms) {
+    TaskTimer *timer = NULL;
+    if (UNLIKELY(this->isForeign()))
+      timer = PF_NEW(TaskTimer);
+    else
+      timer = this->taskThread[this->threadID].newTimer();
+    const uint64 deadlineUs = getTimerUs() + uint64(ms) * 1000;
+    timer->task = &task;
+    timer->tick = (deadlineUs + PF_TASK_TIMER_TICK_US - 1) / PF_TASK_TIMER_TICK_US;
+    int32 toWakeUp = -1;
+    this->timerMutex.lock();
+      atomic_add(&this->timerNum, 1);
+      this->timers.insert(timer);
+      this->nextTimerTick = int64(this->timers.getNextTick());
+      if (this->timeKeeper < 0)
+        toWakeUp = this->sleeping.findFirst();
+      else if (timer->tick < this->timeKeeperTick)
+        toWakeUp = this->timeKeeper;
+    this->timerMutex.unlock();
+
+    // Somebody must sleep with the new deadline in mind
+    if (toWakeUp >= 0 && toWakeUp < int32(this->queueNum))
+      this->taskThread[toWakeUp].tryWakeUp();
+  }
+
+  void TaskScheduler::fireTimers(void) {
+    const uint64 now = getTimerTick();
+    if (int64(now) < this->nextTimerTick) return;
+    this->timerMutex.lock();
+      TaskTimer *timer = this->timers.expire(now);
+      this->nextTimerTick = int64(this->timers.getNextTick());
+    this->timerMutex.unlock();
+    TaskThread &myself = this->taskThread[this->threadID];
+    while (timer) {
+      TaskTimer *next = timer->next;
+      Task *task = timer->task;
+      if (--task->toStart == 0) this->schedule(*task);
+      myself.deleteTimer(timer);
+      atomic_add(&this->timerNum, -1);
+      timer = next;
+    }
+  }
+
+  int64 TaskScheduler::keepTime(uint32 id) {
+    int64 timeoutUs = -1;
+    this->timerMutex.lock();
+      // The timer number is decremented once the expired tasks are scheduled.
+      // The wheel may therefore be already empty
+      const uint64 next = this->timers.getNextTick();
+      if (next != ~0ull && this->timeKeeper < 0) {
+        const uint64 nextUs = next * PF_TASK_TIMER_TICK_US;
+        const uint64 nowUs = getTimerUs();
+        this->timeKeeper = int32(id);
+        this->timeKeeperTick = next;
+        timeoutUs = nextUs > nowUs ? int64(nextUs - nowUs) : 0;
+      }
+    this->timerMutex.unlock();
+    return timeoutUs;
+  }
+
+  void TaskScheduler::releaseTime(uint32 id) {
+    this->timerMutex.lock();
+      PF_ASSERT(this->timeKeeper == int32(id));
+      this->timeKeeper = -1;
+    this->timerMutex.unlock();
+  }
+
+  void TaskScheduler::resume(Task &task) {
+    if (UNLIKELY(this->isForeign())) {
+      this->pushForeign(task);
+      return;
+    }
+    while (UNLIKELY(!this->tryPush(task))) {
+      Task *someTask = this->getTask();
+      if (someTask) this->runTask(someTask);
     }
   }
 
@@ -942,19 +2516,346 @@ namespace pf
       Task *task = this->getTask();
       if (task) this->runTask(task);
       while (UNLIKELY(this->locked)) myself.sleep();
-      if (task == NULL && this->sleepingNum == this->queueNum - 1)
-        return;
+      if (task) continue;
+      if (!this->hasOutstandingTasks()) return;
+
+      // Nothing to run for us. We sleep until there is something to run or
+      // until the last running task is done. The workers that go to sleep will
+      // wake us up in that case
+      atomic_add(&this->waitingAll, 1);
+      myself.sleep();
+      atomic_add(&this->waitingAll, -1);
     }
   }
 
   static TaskScheduler *scheduler = NULL;
-  static TaskAllocator *allocator = NULL;
+  static size_t taskChunkSize = PF_TASK_CHUNK_SIZE;
+  static uint32 taskNodeNum = 0;
 
   void Task::scheduled(void) {
     __store_release(&this->state, uint8(TaskState::SCHEDULED));
     if (--this->toStart == 0) scheduler->schedule(*this);
   }
 
+  // The task is not ended and still referenced by the scheduler while it
+  // waits. The extra start dependency prevents the tasks from rescheduling it
+  // before they are all scheduled. The task is rescheduled by runTask when the
+  // last one ends
+  // The timer holds the start dependency that scheduled would release
+  void Task::scheduledAfter(uint32 ms) {
+    __store_release(&this->state, uint8(TaskState::SCHEDULED));
+    scheduler->addTimer(*this, ms);
+  }
+
+  // Like continueAfter, the task is not ended and still referenced by the
+  // scheduler until the timer reschedules it
+  void Task::runAgainAfter(uint32 ms) {
+    PF_ASSERT(this->state == TaskState::RUNNING);
+    this->toEnd++;
+    this->refInc();
+    this->toStart = 1;
+    scheduler->addTimer(*this, ms);
+  }
+
+  bool Task::continueAfter(Task **tasks, uint32 taskNum) {
+    PF_ASSERT(this->state == TaskState::RUNNING);
+    this->toEnd++;
+    this->refInc();
+    this->toStart = taskNum + 1;
+    for (uint32 i = 0; i < taskNum; ++i) {
+      PF_ASSERT(tasks[i]->state == TaskState::NEW);
+      PF_ASSERT(tasks[i]->toBeStarted == false);
+      tasks[i]->toBeStarted = this;
+      tasks[i]->scheduled();
+    }
+    if (--this->toStart != 0) return true;
+    this->toEnd--;
+    this->refDec(); // The scheduler still references it
+    return false;
+  }
+
+#if PF_TASK_IO
+  TaskReactor::TaskReactor(TaskScheduler &scheduler) : scheduler(scheduler) {
+    this->epollFD = epoll_create1(EPOLL_CLOEXEC);
+    FATAL_IF (this->epollFD < 0, "Unable to create the epoll instance");
+    this->stopFD = eventfd(0, EFD_CLOEXEC);
+    FATAL_IF (this->stopFD < 0, "Unable to create the reactor event");
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = this->stopFD;
+    epoll_ctl(this->epollFD, EPOLL_CTL_ADD, this->stopFD, &event);
+    this->thread = createThread((thread_func) threadFunction, this, 256*KB);
+  }
+
+  TaskReactor::~TaskReactor(void) {
+    const uint64 one = 1;
+    FATAL_IF (write(this->stopFD, &one, sizeof(one)) != sizeof(one),
+              "Unable to stop the reactor");
+    join(this->thread);
+    close(this->stopFD);
+    close(this->epollFD);
+  }
+
+  // The descriptor may still be registered from a previous task (one shot
+  // descriptors remain registered) or for the other direction
+  bool TaskReactor::arm(int fd) {
+    const Waiters &w = this->waiters[fd];
+    struct epoll_event event;
+    event.events = EPOLLONESHOT;
+    if (w.reader) event.events |= EPOLLIN;
+    if (w.writer) event.events |= EPOLLOUT;
+    event.data.fd = fd;
+    if (epoll_ctl(this->epollFD, EPOLL_CTL_ADD, fd, &event) == 0) return true;
+    if (errno == EEXIST)
+      if (epoll_ctl(this->epollFD, EPOLL_CTL_MOD, fd, &event) == 0) return true;
+    FATAL_IF (errno != EPERM, "Unable to wait for the file descriptor");
+    return false;
+  }
+
+  // One reader and one writer may wait for the same descriptor at once.
+  // Regular files cannot be waited for but they are always ready
+  void TaskReactor::wait(TaskIO &task) {
+    const int fd = task.fd;
+    this->mutex.lock();
+    if (size_t(fd) >= this->waiters.size()) this->waiters.resize(fd + 1);
+    Waiters &w = this->waiters[fd];
+    if (task.events & TaskIO::READ) {
+      FATAL_IF (w.reader != NULL, "Two tasks read the same descriptor");
+      w.reader = &task;
+    }
+    if (task.events & TaskIO::WRITE) {
+      FATAL_IF (w.writer != NULL, "Two tasks write the same descriptor");
+      w.writer = &task;
+    }
+    task.waited = true;
+    const bool armed = this->arm(fd);
+    if (!armed) {
+      if (w.reader == &task) w.reader = NULL;
+      if (w.writer == &task) w.writer = NULL;
+      task.waited = false;
+    }
+    this->mutex.unlock();
+    if (!armed) this->scheduler.pushForeign(task);
+  }
+
+  // The descriptor stays registered while the other direction waits
+  void TaskReactor::remove(TaskIO &task) {
+    this->mutex.lock();
+    Waiters &w = this->waiters[task.fd];
+    if (w.reader == &task) w.reader = NULL;
+    if (w.writer == &task) w.writer = NULL;
+    if (w.reader == NULL && w.writer == NULL)
+      epoll_ctl(this->epollFD, EPOLL_CTL_DEL, task.fd, NULL);
+    task.waited = false;
+    this->mutex.unlock();
+  }
+
+  // Errors and hang-ups wake up both directions. The direction that is not
+  // ready is armed again (the descriptor is disabled once it fired)
+  void TaskReactor::threadFunction(TaskReactor *reactor) {
+    enum { maxEventNum = 64 };
+    struct epoll_event events[maxEventNum];
+    for (;;) {
+      const int eventNum = epoll_wait(reactor->epollFD, events, maxEventNum, -1);
+      for (int i = 0; i < eventNum; ++i) {
+        const int fd = events[i].data.fd;
+        if (fd == reactor->stopFD) return;
+        const uint32 ready = events[i].events;
+        TaskIO *reader = NULL, *writer = NULL;
+        reactor->mutex.lock();
+        Waiters &w = reactor->waiters[fd];
+        if (ready & (EPOLLIN | EPOLLERR | EPOLLHUP)) reader = w.reader;
+        if (ready & (EPOLLOUT | EPOLLERR | EPOLLHUP)) writer = w.writer;
+        if (reader == NULL && w.reader == writer) reader = writer;
+        if (writer == NULL && w.writer == reader) writer = reader;
+        if (reader) w.reader = NULL;
+        if (writer) w.writer = NULL;
+        if (w.reader || w.writer) reactor->arm(fd);
+        reactor->mutex.unlock();
+        if (reader) reactor->scheduler.pushForeign(*reader);
+        if (writer && writer != reader) reactor->scheduler.pushForeign(*writer);
+      }
+    }
+  }
+
+  TaskIO::TaskIO(int fd, uint32 events, const char *name) :
+    Task(name), fd(fd), events(events), waited(false)
+  {
+    const int flags = fcntl(fd, F_GETFL);
+    FATAL_IF (flags < 0 || !(flags & O_NONBLOCK),
+              "TaskIO needs a valid non-blocking descriptor");
+  }
+
+  // Once handed to the reactor, the task may run again on another thread
+  // right away. So, we do not touch it anymore
+  Task *TaskIO::run(void) {
+    if (this->process()) {
+      if (this->waited) scheduler->reactor->remove(*this);
+    } else
+      scheduler->waitIO(*this);
+    return NULL;
+  }
+#endif /* PF_TASK_IO */
+
+  void TaskEvent::wait(void) {
+    FATAL_IF (scheduler == NULL, "scheduler not started");
+    scheduler->wait(*this);
+  }
+
+  void TaskEvent::signal(void) {
+    FATAL_IF (scheduler == NULL, "scheduler not started");
+    this->mutex.lock();
+    this->signaled = true;
+    Task *task = this->waiters;
+    const bool foreign = this->foreignNum != 0;
+    this->waiters = NULL;
+    this->mutex.unlock();
+    if (foreign) scheduler->signalForeign();
+    while (task) {
+      Task *next = task->next;
+      task->next = NULL;
+      scheduler->resume(*task);
+      task = next;
+    }
+  }
+
+  void TaskEvent::reset(void) {
+    this->mutex.lock();
+    this->signaled = false;
+    this->mutex.unlock();
+  }
+
+  /*! Low priority task that gives free chunks back to the system */
+  class TaskReclaim : public Task
+  {
+  public:
+    TaskReclaim(void) : Task("TaskReclaim") {
+      this->setPriority(TaskPriority::LOW);
+    }
+    virtual Task *run(void) {
+      allocator->reclaim();
+      return NULL;
+    }
+  };
+
+  void TaskAllocator::reclaimIfNeeded(void) {
+    if (LIKELY(size_t(atomic_t(this->globalSize)) <= this->highWater)) return;
+    if (scheduler == NULL || this->reclaiming) return;
+    // A foreign thread may hold the lock of its storage here
+    if (TaskScheduler::threadID >= this->threadNum) return;
+    if (atomic_cmpxchg(&this->reclaiming, 1, 0) != 0) return;
+    Task *task = PF_NEW(TaskReclaim);
+    task->scheduled();
+  }
+
+  // We take a whole global heap to let its owner work while we traverse it.
+  // It may push new lists meanwhile. First, we count the free tasks per chunk.
+  // Then, we rebuild the lists without the tasks of the completely free
+  // chunks. Their pages are released only after since their tasks are linked
+  // together
+  void TaskAllocator::reclaimHeap(TaskFreeStack &heap, uint32 chunkID,
+                                  std::vector<void*> &toRelease)
+  {
+    void *lists = heap.popAll();
+    uintptr_t takenSize = 0;
+    for (void *list = lists; list; list = ((void**) list)[1])
+      takenSize += ((uintptr_t *) list)[2];
+    this->globalSize += -atomic_t(takenSize);
+
+    for (void *list = lists; list; list = ((void**) list)[1])
+      for (void *elem = list; elem; elem = *(void**) elem)
+        TaskStorage::getChunk(elem)->freeNum = 0;
+    for (void *list = lists; list; list = ((void**) list)[1])
+      for (void *elem = list; elem; elem = *(void**) elem)
+        TaskStorage::getChunk(elem)->freeNum++;
+
+    // Rebuild lists of about one batch
+    const uint32 elemSize = TaskStorage::heapSize[chunkID];
+    void *kept = NULL, *head = NULL, *tail = NULL;
+    uintptr_t size = 0;
+    void *list = lists;
+    while (list) {
+      void *nextList = ((void**) list)[1];
+      void *elem = list;
+      while (elem) {
+        void *next = *(void**) elem;
+        TaskChunk *chunk = TaskStorage::getChunk(elem);
+        if (chunk->freeNum == chunk->elemNum) {
+          toRelease.push_back(chunk);
+          chunk->freeNum = 0; // Only once per chunk
+        } else if (chunk->freeNum != 0) {
+          if (head == NULL) head = elem; else *(void**) tail = elem;
+          tail = elem;
+          size += elemSize;
+          if (size >= TaskStorage::getBatchSize(chunkID)) {
+            *(void**) tail = NULL;
+            ((void**) head)[1] = kept;
+            ((uintptr_t *) head)[2] = size;
+            kept = head;
+            head = NULL;
+            size = 0;
+          }
+        }
+        elem = next;
+      }
+      list = nextList;
+    }
+    if (head) {
+      *(void**) tail = NULL;
+      ((void**) head)[1] = kept;
+      ((uintptr_t *) head)[2] = size;
+      kept = head;
+    }
+
+    // Put back what we kept
+    while (kept) {
+      void *next = ((void**) kept)[1];
+      this->globalSize += ((uintptr_t *) kept)[2];
+      heap.push(kept);
+      kept = next;
+    }
+  }
+
+  // The owners keep pushing lists while we reclaim and reclaimIfNeeded ignores
+  // them since we are running. We therefore run again if some were pushed.
+  // Both sides use locked instructions such that one of them sees the other.
+  // The next pass is a new task: under a steady churn, we never hold the
+  // worker for more than one pass
+  void TaskAllocator::reclaim(void) {
+    const atomic_t startPushNum = this->pushNum;
+    std::vector<void*> toRelease[maxHeap];
+    for (uint32 t = 0; t < storageNum; ++t) this->local[t].flushRemote();
+    for (uint32 t = 0; t < storageNum; ++t)
+      for (uint32 i = 0; i < maxHeap; ++i)
+        this->reclaimHeap(this->local[t].global[i], i, toRelease[i]);
+    for (uint32 i = 0; i < maxHeap; ++i)
+      for (size_t j = 0; j < toRelease[i].size(); ++j)
+        releasePages(toRelease[i][j], TaskStorage::getChunkBytes(i));
+
+    this->mutex.lock();
+      for (uint32 i = 0; i < maxHeap; ++i) {
+        std::vector<void*> &chunks = this->released[TaskStorage::getChunkClass(i)];
+        chunks.insert(chunks.end(), toRelease[i].begin(), toRelease[i].end());
+        this->releasedSize += toRelease[i].size() * TaskStorage::getChunkBytes(i);
+      }
+    this->mutex.unlock();
+    atomic_cmpxchg(&this->reclaiming, 0, 1);
+    if (this->pushNum != startPushNum) this->reclaimIfNeeded();
+  }
+
+  void TaskAllocator::setHighWater(size_t bytes) {
+    this->highWater = bytes;
+    this->reclaimIfNeeded();
+  }
+
+  // The regions are bound before anyone touches them. The storage itself was
+  // already touched by its constructor so its pages are moved
+  void TaskAllocator::setNode(uint32 id, int32 node) {
+    TaskStorage &storage = this->local[id];
+    storage.node = node;
+    if (node >= 0) bindPages(&storage, sizeof(TaskStorage), node);
+  }
+
 #if PF_TASK_USE_DEDICATED_ALLOCATOR
   void *Task::operator new(size_t size) {
     FATAL_IF (allocator == NULL, "scheduler not started");
@@ -1007,22 +2908,59 @@ namespace pf
     return NULL;
   }
 
+  Task* TaskRange::run(void)
+  {
+    // Same rescheduling trick as the task sets. Only the claiming differs:
+    // a thread takes a whole block of elements with one atomic add. A copy
+    // that still finds work was picked up by another thread (the first
+    // runner only picks up its own copies once the range is exhausted). So
+    // runnerNum is the number of thieves plus one and we make the blocks
+    // smaller as it grows to give everybody a share of the tail
+    if (this->next >= this->end) return NULL;
+    this->runnerNum++;
+    if (this->end - this->next > this->grain) {
+      this->toEnd += 2;
+      this->refInc(); // One more reference in the scheduler
+      scheduler->schedule(*this);
+      // See TaskSet::run. The second scheduling is only a try
+      this->refInc();
+      if (UNLIKELY(!scheduler->trySchedule(*this))) {
+        this->toEnd--;
+        this->refDec();
+      }
+    }
+    for (;;) {
+      const atomic_t left = this->end - this->next;
+      if (left <= 0) break;
+      const atomic_t share = left / (PF_TASK_RANGE_SPLIT * this->runnerNum);
+      const atomic_t size = share > this->grain ? share : this->grain;
+      const atomic_t first = (this->next += size) - size;
+      if (first >= this->end) break;
+      const atomic_t last = first + size < this->end ? first + size : this->end;
+      this->run(size_t(first), size_t(last));
+    }
+    return NULL;
+  }
+
   void TaskingSystemStart(int32 workerNum) {
-    static const uint32 bitsPerByte = 8;
-    FATAL_IF (workerNum >= int32(sizeof(size_t)*bitsPerByte), "Too many workers are required");
+    FATAL_IF (workerNum >= int32(Bitmap::maxBitNum), "Too many workers are required");
     FATAL_IF (scheduler != NULL, "scheduler is already running");
     // flush to zero and no denormals
     _mm_setcsr(_mm_getcsr() | (1<<15) | (1<<6));
-    scheduler = PF_NEW(TaskScheduler, workerNum);
-    allocator = PF_NEW(TaskAllocator, scheduler->getWorkerNum()+1);
+    scheduler = PF_NEW(TaskScheduler, workerNum, taskNodeNum);
+    const uint32 threadNum = scheduler->getWorkerNum() + 1;
+    TaskAllocator *taskAllocator = PF_NEW(TaskAllocator, threadNum, taskChunkSize);
+    for (uint32 i = 0; i < threadNum; ++i)
+      taskAllocator->setNode(i, scheduler->getMemoryNode(i));
+    allocator = taskAllocator;
   }
 
   void TaskingSystemEnd(void) {
     scheduler->waitAll();      // Empty the queues (ie wait for all tasks)
     scheduler->stopAll();      // Kill all the threads
     PF_SAFE_DELETE(scheduler); // Deallocate the scheduler
+    scheduler = NULL;          // No reclaimer task from now on
     PF_SAFE_DELETE(allocator); // Release the tasks allocator
-    scheduler = NULL;
     allocator = NULL;
   }
 
@@ -1033,16 +2971,26 @@ namespace pf
 
   void TaskingSystemWait(Ref<Task> task) {
     FATAL_IF (scheduler == NULL, "scheduler not started");
+    FATAL_IF (scheduler->isForeign(), "foreign threads do not run tasks");
     scheduler->wait(task);
   }
 
   void TaskingSystemWaitAll(void) {
     FATAL_IF (scheduler == NULL, "scheduler not started");
+    FATAL_IF (scheduler->getThreadID() != PF_TASK_MAIN_THREAD,
+              "only the main thread waits for all the tasks");
     scheduler->waitAll();
   }
 
+  bool TaskingSystemRunSomething(void) {
+    FATAL_IF (scheduler == NULL, "scheduler not started");
+    FATAL_IF (scheduler->isForeign(), "foreign threads do not run tasks");
+    return scheduler->runSomething();
+  }
+
   void TaskingSystemLock(void) {
     FATAL_IF (scheduler == NULL, "scheduler not started");
+    FATAL_IF (scheduler->isForeign(), "foreign threads do not run tasks");
     scheduler->lock();
   }
 
@@ -1074,6 +3022,56 @@ namespace pf
     TaskingSystemUnlock();
   }
 #endif /* PF_TASK_PROFILER */
+
+  size_t TaskingSystemGetTaskMemory(void) {
+    FATAL_IF (allocator == NULL, "scheduler not started");
+    return allocator->getMemory();
+  }
+
+  size_t TaskingSystemGetTaskSizeClass(size_t bytes) {
+    FATAL_IF (allocator == NULL, "scheduler not started");
+    return TaskAllocator::getSizeClass(bytes);
+  }
+
+  size_t TaskingSystemGetTaskChunkHeaderSize(void) {
+    return TaskStorage::headerSize;
+  }
+
+  void TaskingSystemSetTaskMemoryHighWater(size_t bytes) {
+    FATAL_IF (allocator == NULL, "scheduler not started");
+    allocator->setHighWater(bytes);
+  }
+
+  void TaskingSystemSetTaskChunkSize(size_t bytes) {
+    FATAL_IF (allocator != NULL, "task allocator already started");
+    FATAL_IF (!isPowerOf<2>(bytes) ||
+              bytes < TaskStorage::minChunkSize ||
+              bytes > TaskStorage::maxChunkSize, "invalid task chunk size");
+    taskChunkSize = bytes;
+  }
+
+  void TaskingSystemSetNumaNodeNum(uint32 nodeNum) {
+    FATAL_IF (scheduler != NULL, "scheduler is already running");
+    taskNodeNum = nodeNum;
+  }
+
+  void TaskingSystemSetWakeUpAlways(bool always) {
+    FATAL_IF (scheduler == NULL, "scheduler not started");
+    TaskingSystemLock();
+    scheduler->setWakeUpAlways(always);
+    TaskingSystemUnlock();
+  }
+
+  uint64 TaskingSystemGetStealNum(uint32 thiefNode, uint32 victimNode) {
+    FATAL_IF (scheduler == NULL, "scheduler not started");
+    return scheduler->getStealNum(thiefNode, victimNode);
+  }
+
+  uint32 TaskingSystemGetThreadNode(void) {
+    FATAL_IF (scheduler == NULL, "scheduler not started");
+    const uint32 id = scheduler->getThreadID();
+    return id == PF_TASK_FOREIGN_THREAD ? 0 : scheduler->getNode(id);
+  }
 }
 
 #undef IF_TASK_STATISTICS
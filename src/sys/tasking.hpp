@@ -19,6 +19,7 @@
 
 #include "sys/ref.hpp"
 #include "sys/atomic.hpp"
+#include "sys/mutex.hpp"
 
 /*                   *** OVERVIEW OF THE TASKING SYSTEM ***
  *
@@ -50,6 +51,8 @@
  * We also classicaly implement a TaskSet which is a function which can be run
  * n times (concurrently on any number of threads). TaskSet are a particularly
  * efficient way to logically create n tasks in one chunk.
+ * A TaskRange does the same over a range of elements but the threads claim
+ * contiguous blocks of them instead of one element at a time.
  *
  * Last feature we added is the ability to run *some* task (ie the user cannot
  * decide what it will run) from a running task (ie from the run function of the
@@ -59,7 +62,23 @@
  * scheduler is not going to run the task you just pushed? Our idea (to assert
  * in later tests) is to offer the ability to run *something* already ready to
  * hide the IO latency from the task itself. At least, you can keep the HW
- * thread busy if you want to.
+ * thread busy if you want to. This is what TaskingSystemRunSomething does.
+ *
+ * A task may also be *suspendable*. Such a task runs on its own fiber (ie a
+ * user-mode context with a small pooled stack). When it waits for a TaskEvent,
+ * it is simply put aside and the thread runs other tasks. Once the event is
+ * signaled, any thread may resume it. Latency bound tasks can therefore wait
+ * without blocking a HW thread and without oversubscribing the system threads.
+ * Nothing else runs on the small stack of a fiber: a suspendable task waiting
+ * for a task (TaskingSystemWait) is put aside until the task is done
+ *
+ * Threads outside the tasking system (called *foreign* threads, a network
+ * thread for example) may also create tasks, set their dependencies, schedule
+ * them (also with Task::scheduledAfter) and release them. Their tasks go
+ * through a lock-free injection queue that the workers poll before stealing.
+ * They may also wait for a TaskEvent (they simply block). Foreign threads do
+ * not run tasks so they cannot wait for them (TaskingSystemWait and
+ * TaskingSystemWaitAll), run something nor lock the tasking system
  *
  *               *** SOME DETAILS ABOUT THE IMPLEMENTATION ***
  *
@@ -81,9 +100,10 @@
  *     first order. If its queue is empty, it tries to *steal* a task from
  *     another HW thread in breadth first order. This approach strongly limits
  *     the memory requirement (ie the number of task currently allocated in the
- *     system) while also limiting the contention in the queues. Right now, the
- *     queues still use spin locks but a classical ABP lock free queue is
- *     clearly coming :-)
+ *     system) while also limiting the contention in the queues. The queues
+ *     are lock-free Chase-Lev deques (one per priority): the owner pushes and
+ *     pops at the head without any atomic operation (only a fence) while the
+ *     stealers use a CAS on the tail
  *
  * 3 - A classical FIFO queue approach. Beside its work stealing queue, each
  *     thread owns another FIFO dedicated to tasks with affinities. Basically,
@@ -130,18 +150,92 @@
 /*! Use or not the fast allocator */
 #define PF_TASK_USE_DEDICATED_ALLOCATOR 1
 
+/*! Default number of free bytes in the global heap of the allocator beyond
+ *  which a low priority task gives the completely free chunks back to the
+ *  system (see TaskingSystemSetTaskMemoryHighWater)
+ */
+#define PF_TASK_MEMORY_HIGH_WATER (4 << 20)
+
+/*! Default size of the chunks the task allocator cuts into tasks (see
+ *  TaskingSystemSetTaskChunkSize)
+ */
+#define PF_TASK_CHUNK_SIZE (4 << 10)
+
+/*! The task allocator takes its chunks from regions of this size. They are
+ *  aligned such that the system may back them with huge pages
+ */
+#define PF_TASK_REGION_SIZE (2 << 20)
+
 /*! Store or not run-time statistics in the tasking system */
 #define PF_TASK_STATICTICS 0
 
 /*! Enable or not the profiling interface */
 #define PF_TASK_PROFILER 1
 
-/*! Give number of tries before yielding (multiplied by number of threads) */
+/*! Initial number of tasks per priority in the work stealing queues */
+#define PF_TASK_QUEUE_INIT_SIZE 256
+
+/*! The work stealing queues grow up to this number of tasks per priority.
+ *  Beyond it, the thread runs other tasks until some room is available
+ *  (must be a power of 2)
+ */
+#define PF_TASK_QUEUE_MAX_SIZE (1 << 20)
+
+/*! Maximum number of tasks a thread steals at once from another thread (it
+ *  never takes more than half of the victim queue)
+ */
+#define PF_TASK_STEAL_MAX 8
+
+/*! A thread running a TaskRange claims at most 1/PF_TASK_RANGE_SPLIT of its
+ *  share of the remaining elements at once
+ */
+#define PF_TASK_RANGE_SPLIT 4
+
+/*! Give number of tries before yielding */
 #define PF_TASK_TRIES_BEFORE_YIELD 64
 
+/*! Maximum number of nested TaskingSystemRunSomething calls per thread */
+#define PF_TASK_RUN_SOMETHING_MAX_DEPTH 8
+
+/*! Maximum number of nested waits that run other tasks per thread. Deeper
+ *  waits let the other threads run the awaited task
+ */
+#define PF_TASK_WAIT_MAX_DEPTH 64
+
+/*! I/O tasks need the reactor that waits with epoll (only Linux for now) */
+#if defined(__LINUX__)
+#define PF_TASK_IO 1
+#else
+#define PF_TASK_IO 0
+#endif /* defined(__LINUX__) */
+
+/*! Resolution of the timers (in microseconds) */
+#define PF_TASK_TIMER_TICK_US 100
+
+/*! A busy thread looks for expired timers (and reads the clock) every
+ *  PF_TASK_TIMER_CHECK tasks
+ */
+#define PF_TASK_TIMER_CHECK 64
+
+/*! Stack size of the fibers that run the suspendable tasks. Only the task
+ *  itself runs on it (a waiting suspendable task never runs other tasks). A
+ *  guard page below it catches the overflows
+ */
+#define PF_TASK_FIBER_STACK_SIZE (64 * 1024)
+
 /*! Main thread (the one that the system gives us) is always 0 */
 #define PF_TASK_MAIN_THREAD 0
 
+/*! ID of the threads outside the tasking system (see
+ *  TaskingSystemGetThreadID)
+ */
+#define PF_TASK_FOREIGN_THREAD 0xffffffffu
+
+/*! Number of task storages the threads outside the tasking system share to
+ *  allocate their tasks. Each one is protected by its own lock
+ */
+#define PF_TASK_FOREIGN_STORAGE_NUM 4
+
 /*! No affinity means that the task can rn anywhere */
 #define PF_TASK_NO_AFFINITY 0xffffu
 
@@ -180,6 +274,8 @@ namespace pf
     };
   };
 
+  struct TaskFiber; // Runs a suspendable task (see tasking.cpp)
+
   /*! Interface for all tasks handled by the tasking system */
   class Task : public RefCount, public NonCopyable
   {
@@ -194,6 +290,8 @@ namespace pf
     virtual Task* run(void) = 0;
     /*! Task is built and will be ready when all start dependencies are over */
     void scheduled(void);
+    /*! Same but the task also cannot start before ms milliseconds */
+    void scheduledAfter(uint32 ms);
     /*! The given task cannot *start* as long as "other" is not complete */
     INLINE void starts(Task *other);
     /*! The given task cannot *end* as long as "other" is not complete */
@@ -205,24 +303,48 @@ namespace pf
     INLINE uint16 getAffinity(void) const;
     /*! Get the current task state */
     INLINE uint8 getState(void) const;
+    /*! A suspendable task runs on a fiber and can be suspended while it waits
+     *  for a TaskEvent (task sets cannot be suspendable)
+     */
+    INLINE void setSuspendable(bool suspendable);
+    INLINE bool isSuspendable(void) const;
     /*! Tasks may use a scalable fixed size allocator */
     void* operator new(size_t size);
     /*! Deallocations may go through the dedicated allocator too */
     void operator delete(void* ptr);
 
+  protected:
+    /*! Only from the run function: schedule the given (new) tasks and run this
+     *  task again once they are all done. The run function must return right
+     *  after (the task may already run again on another thread). Returns false
+     *  if the tasks are already done. In that case, the task is not run again
+     */
+    bool continueAfter(Task **tasks, uint32 taskNum);
+    /*! Only from the run function: run this task again in ms milliseconds.
+     *  The run function must return right after. A task that calls it at each
+     *  run is periodic. Like any pending task, it keeps TaskingSystemWaitAll
+     *  and TaskingSystemEnd waiting: it must stop calling it first
+     */
+    void runAgainAfter(uint32 ms);
+
   private:
-    template <int> friend struct TaskWorkStealingQueue; //!< Contains tasks
-    template <int> friend struct TaskAffinityQueue;     //!< Contains tasks
+    friend struct TaskWorkStealingQueue;                //!< Contains tasks
+    friend struct TaskAffinityQueue;                    //!< Contains tasks
     friend class TaskSet;      //!< Will tweak the ending criterium
+    friend class TaskRange;    //!< Idem
     friend class TaskScheduler;//!< Needs to access everything
+    friend class TaskEvent;    //!< Links the suspended tasks
     Ref<Task> toBeEnded;       //!< Signals it when finishing
     Ref<Task> toBeStarted;     //!< Triggers it when ready
     const char *name;          //!< Debug facility mostly
+    Task *next;                //!< Links the tasks in the affinity queues
+    TaskFiber *fiber;          //!< Fiber of a running suspendable task
     Atomic32 toStart;          //!< MBZ before starting
     Atomic32 toEnd;            //!< MBZ before ending
     uint16 affinity;           //!< The task will run on a particular thread
     uint8 priority;            //!< Task priority
     volatile uint8 state;      //!< Assert correctness of the operations
+    bool suspendable;          //!< Run it on a fiber
     void* operator new[](size_t size);
     void  operator delete[](void* ptr);
   };
@@ -240,6 +362,79 @@ namespace pf
     Atomic elemNum;          //!< Number of outstanding elements
   };
 
+  /*! Run a function over the blocks of [begin,end). Like a TaskSet, it is
+   *  rescheduled to spread over the threads but a thread claims a whole
+   *  block of contiguous elements with one atomic. Blocks are never smaller
+   *  than grain and shrink as more threads steal the task (see
+   *  PF_TASK_RANGE_SPLIT)
+   */
+  class TaskRange : public Task
+  {
+  public:
+    /*! The run function is called on blocks of [begin,end) */
+    INLINE TaskRange(size_t begin, size_t end, size_t grain = 1, const char *name = NULL);
+    /*! This function is user-specified. It processes [begin,end) */
+    virtual void run(size_t begin, size_t end) = 0;
+  private:
+    virtual Task* run(void); //!< Claims and runs the blocks
+    Atomic next;             //!< First unclaimed element
+    Atomic runnerNum;        //!< Number of threads that found work in it
+    const atomic_t end;      //!< One past the last element
+    const atomic_t grain;    //!< Minimum block size
+  };
+
+#if PF_TASK_IO
+  /*! Non-blocking I/O on a file descriptor. The caller opens it with
+   *  O_NONBLOCK (the flags are shared by all the users of the descriptor so
+   *  we do not change them). If the operation would block, the task is
+   *  handed to the reactor thread that
+   *  waits for the descriptor and pushes the task again once it is ready. The
+   *  task therefore ends (and starts its dependent task) when the operation
+   *  is complete. No worker is blocked in the mean time
+   */
+  class TaskIO : public Task
+  {
+  public:
+    /*! What we wait for on the descriptor */
+    enum { READ = 1u, WRITE = 2u };
+    TaskIO(int fd, uint32 events, const char *name = NULL);
+    /*! Do the I/O. Return false if it would block */
+    virtual bool process(void) = 0;
+    INLINE int getFD(void) const { return this->fd; }
+  private:
+    virtual Task* run(void); //!< Reimplemented for all I/O tasks
+    friend class TaskReactor; //!< Waits for the descriptor
+    int fd;                  //!< Descriptor to wait for
+    uint32 events;           //!< READ and / or WRITE
+    bool waited;             //!< Registered in the reactor
+  };
+#endif /* PF_TASK_IO */
+
+  /*! Tasks can wait for an event. A suspendable task that waits is suspended:
+   *  the thread runs other tasks and any thread resumes it once the event is
+   *  signaled. Other waiters (regular tasks, main thread) run other tasks
+   *  until the event is signaled
+   */
+  class TaskEvent : public NonCopyable
+  {
+  public:
+    INLINE TaskEvent(void) : waiters(NULL), foreignNum(0), signaled(false) {}
+    /*! Wait until the event is signaled. A foreign thread blocks */
+    void wait(void);
+    /*! Signal the event and resume the waiters */
+    void signal(void);
+    /*! The event is not signaled anymore */
+    void reset(void);
+    /*! Tell if the event is signaled */
+    INLINE bool isSignaled(void) const { return this->signaled; }
+  private:
+    friend class TaskScheduler; //!< Suspends the tasks
+    MutexActive mutex;          //!< Protects the waiters
+    Task *waiters;              //!< Suspended tasks (linked with Task::next)
+    uint32 foreignNum;          //!< Foreign threads blocked on it
+    volatile bool signaled;     //!< Set by signal, cleared by reset
+  };
+
 #if PF_TASK_PROFILER
   /*! Callback collection to record useful events in the tasking system */
   class TaskProfiler
@@ -267,21 +462,37 @@ namespace pf
    */
   void TaskingSystemStart(int workerNum = -1);
 
-  /*! Shutdown and deallocate the tasking system (MAIN THREAD outside a Task) */
+  /*! Shutdown and deallocate the tasking system (MAIN THREAD outside a Task).
+   *  It first waits for all pending tasks (see TaskingSystemWaitAll)
+   */
   void TaskingSystemEnd(void);
 
   /*! Make the main thread enter the tasking system (MAIN THREAD outside a Task) */
   void TaskingSystemEnter(void);
 
-  /*! Wait for a task to complete (MAIN THREAD outside a Task) */
+  /*! Wait for a task to complete (MAIN THREAD outside a Task or any running
+   *  Task). While waiting, the thread runs other tasks (up to
+   *  PF_TASK_WAIT_MAX_DEPTH nested waits) and backs off when there is
+   *  nothing to run. From a Task, the awaited task must not depend on the
+   *  completion of the waiting one
+   */
   void TaskingSystemWait(Ref<Task> task);
 
   /*! Wait until all pending tasks have been executed. When the function
    *  returns, we are sure that nothing can be run anymore (MAIN THREAD outside
-   *  a Task)
+   *  a Task). The tasks waiting for their timer are pending too: the function
+   *  never returns while a periodic task keeps calling Task::runAgainAfter
    */
   void TaskingSystemWaitAll(void);
 
+  /*! Run one ready task (from our queues or stolen) if any. A running Task can
+   *  poll a non-blocking resource and stay busy in between. Return false if
+   *  nothing was run. Nested calls are limited (see
+   *  PF_TASK_RUN_SOMETHING_MAX_DEPTH) to bound the stack growth. Nothing is
+   *  run from a suspendable task (its fiber stack is small)
+   */
+  bool TaskingSystemRunSomething(void);
+
   /*! Lock the tasking system. After the lock, only one thread is running.
    *  All other threads are sleeping. This is a particularly expensive
    *  operation so use it with moderation :-)
@@ -297,7 +508,9 @@ namespace pf
   /*! Number of threads currently in the tasking system (*including main*) */
   uint32 TaskingSystemGetThreadNum(void);
 
-  /*! Return the ID of the calling thread (between 0 and threadNum) */
+  /*! Return the ID of the calling thread (between 0 and threadNum) or
+   *  PF_TASK_FOREIGN_THREAD for a thread outside the tasking system
+   */
   uint32 TaskingSystemGetThreadID(void);
 
 #if PF_TASK_PROFILER
@@ -305,16 +518,59 @@ namespace pf
   void TaskingSystemSetProfiler(TaskProfiler *profiler);
 #endif /* PF_TASK_PROFILER */
 
+  /*! Memory taken by the task allocator and not given back to the system */
+  size_t TaskingSystemGetTaskMemory(void);
+
+  /*! Bytes the task allocator really uses for a task of the given size */
+  size_t TaskingSystemGetTaskSizeClass(size_t bytes);
+
+  /*! Bytes of the header at the start of each chunk of tasks */
+  size_t TaskingSystemGetTaskChunkHeaderSize(void);
+
+  /*! Free memory kept by the task allocator before it gives some back to the
+   *  system (see PF_TASK_MEMORY_HIGH_WATER)
+   */
+  void TaskingSystemSetTaskMemoryHighWater(size_t bytes);
+
+  /*! Size of the chunks the task allocator cuts into tasks (a power of 2
+   *  between 4KB and 1MB, see PF_TASK_CHUNK_SIZE). It must be called before
+   *  TaskingSystemStart
+   */
+  void TaskingSystemSetTaskChunkSize(size_t bytes);
+
+  /*! Simulate a NUMA system with nodeNum nodes. Consecutive threads go on the
+   *  same node. 0 (the default) uses the nodes of the system as described
+   *  in /sys/devices/system/node. It must be called before
+   *  TaskingSystemStart
+   */
+  void TaskingSystemSetNumaNodeNum(uint32 nodeNum);
+
+  /*! NUMA node (real or simulated) of the calling thread */
+  uint32 TaskingSystemGetThreadNode(void);
+
+  /*! Number of steals done by the threads of thiefNode from the threads of
+   *  victimNode since TaskingSystemStart. The scheduler always counts them
+   *  (one counter per thread and per node) to check the victim policy
+   */
+  uint64 TaskingSystemGetStealNum(uint32 thiefNode, uint32 victimNode);
+
+  /*! Wake up a sleeping thread at each push even if other threads already
+   *  look for tasks, as the scheduler did before it counted them. It is only
+   *  meant to measure the wake ups this saves (false by default)
+   */
+  void TaskingSystemSetWakeUpAlways(bool always);
+
   ///////////////////////////////////////////////////////////////////////////
   /// Implementation of the inlined functions
   ///////////////////////////////////////////////////////////////////////////
 
   INLINE Task::Task(const char *taskName) :
-    name(taskName),
+    name(taskName), next(NULL), fiber(NULL),
     toStart(1), toEnd(1),
     affinity(PF_TASK_NO_AFFINITY),
     priority(uint8(TaskPriority::NORMAL)),
-    state(uint8(TaskState::NEW))
+    state(uint8(TaskState::NEW)),
+    suspendable(false)
   {
     // The scheduler will remove this reference once the task is done
     this->refInc();
@@ -353,13 +609,25 @@ namespace pf
     this->affinity = affi;
   }
 
+  INLINE void Task::setSuspendable(bool suspendable) {
+    PF_ASSERT(this->state == TaskState::NEW);
+    this->suspendable = suspendable;
+  }
+
   INLINE uint8 Task::getPriority(void)  const { return this->priority; }
   INLINE uint16 Task::getAffinity(void) const { return this->affinity; }
   INLINE uint8 Task::getState(void)  const { return this->state; }
+  INLINE bool Task::isSuspendable(void) const { return this->suspendable; }
 
   INLINE TaskSet::TaskSet(size_t elemNum, const char *name) :
     Task(name), elemNum(elemNum) {}
 
+  INLINE TaskRange::TaskRange(size_t begin, size_t end, size_t grain, const char *name) :
+    Task(name), next(begin), runnerNum(0), end(end), grain(grain > 0 ? grain : 1)
+  {
+    PF_ASSERT(begin <= end);
+  }
+
 } /* namespace pf */
 
 #endif /* __PF_TASKING_HPP__ */
@@ -0,0 +1,111 @@
+// ======================================================================== //
+// Copyright 2009-2011 Intel Corporation                                    //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#ifndef __PF_TASKING_COROUTINE_HPP__
+#define __PF_TASKING_COROUTINE_HPP__
+
+#include "sys/tasking.hpp"
+
+/*! Coroutines require C++20 (the rest of the tasking system does not) */
+#if defined(__has_include) && __cplusplus >= 202002L
+#if __has_include(<coroutine>)
+#define PF_TASK_COROUTINE 1
+#endif /* __has_include(<coroutine>) */
+#endif /* defined(__has_include) && __cplusplus >= 202002L */
+
+#if PF_TASK_COROUTINE
+#include <coroutine>
+
+/* A coroutine returning Ref<TaskCoroutine> is a task. Nothing runs until the
+ * task is scheduled. co_await on a new task schedules it and the coroutine
+ * resumes (possibly on another thread) once it is done. This replaces the
+ * chains of start and end dependencies with straight-line code:
+ *
+ * Ref<TaskCoroutine> fibo(uint64 rank, uint64 *result) {
+ *   if (rank < 2) { *result = rank; co_return; }
+ *   uint64 left, right;
+ *   co_await TaskAll(fibo(rank-1, &left), fibo(rank-2, &right));
+ *   *result = left + right;
+ * }
+ */
+namespace pf
+{
+  /*! Task that runs a coroutine. Each run resumes it */
+  class TaskCoroutine : public Task
+  {
+  public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> handle_type;
+    /*! Coroutine frames come from the task allocator too */
+    struct promise_type {
+      INLINE void *operator new(size_t size) { return Task::operator new(size); }
+      INLINE void operator delete(void *ptr) { Task::operator delete(ptr); }
+      INLINE TaskCoroutine *get_return_object(void) {
+        this->task = PF_NEW(TaskCoroutine, handle_type::from_promise(*this));
+        return this->task;
+      }
+      INLINE std::suspend_always initial_suspend(void) { return {}; }
+      INLINE std::suspend_always final_suspend(void) noexcept { return {}; }
+      INLINE void return_void(void) {}
+      INLINE void unhandled_exception(void) { FATAL("Exception in a coroutine"); }
+      TaskCoroutine *task; //!< Task that owns the coroutine
+    };
+    INLINE TaskCoroutine(handle_type handle) :
+      Task("TaskCoroutine"), handle(handle) {}
+    INLINE ~TaskCoroutine(void) { this->handle.destroy(); }
+    /*! Resumes the coroutine until it suspends itself or returns */
+    virtual Task *run(void) { this->handle.resume(); return NULL; }
+    /*! Schedule the tasks and resume the coroutine once they are done */
+    INLINE bool suspendUntil(Task **tasks, uint32 taskNum) {
+      return this->continueAfter(tasks, taskNum);
+    }
+  private:
+    handle_type handle; //!< Our coroutine
+  };
+
+  /*! Awaits a fixed number of new tasks */
+  template <uint32 taskNum>
+  struct TaskAwaiter {
+    INLINE bool await_ready(void) const { return false; }
+    INLINE bool await_suspend(TaskCoroutine::handle_type handle) {
+      return handle.promise().task->suspendUntil(this->tasks, taskNum);
+    }
+    INLINE void await_resume(void) const {}
+    Task *tasks[taskNum]; //!< New tasks to schedule and wait for
+  };
+
+  /*! Wait for one new task */
+  template <typename T>
+  INLINE TaskAwaiter<1> operator co_await(const Ref<T> &task) {
+    return TaskAwaiter<1>{{task.ptr}};
+  }
+
+  /*! Wait for several new tasks */
+  template <typename... T>
+  INLINE TaskAwaiter<sizeof...(T)> TaskAll(const Ref<T>&... tasks) {
+    return TaskAwaiter<sizeof...(T)>{{tasks.ptr...}};
+  }
+} /* namespace pf */
+
+/*! Coroutines that return Ref<TaskCoroutine> are task coroutines */
+template <typename... Args>
+struct std::coroutine_traits<pf::Ref<pf::TaskCoroutine>, Args...> {
+  typedef pf::TaskCoroutine::promise_type promise_type;
+};
+
+#endif /* PF_TASK_COROUTINE */
+#endif /* __PF_TASKING_COROUTINE_HPP__ */
+
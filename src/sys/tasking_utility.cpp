@@ -16,6 +16,11 @@
 
 #include "tasking_utility.hpp"
 
+#if PF_TASK_IO
+#include <unistd.h>
+#include <errno.h>
+#endif /* PF_TASK_IO */
+
 namespace pf
 {
   TaskInterruptMain::TaskInterruptMain(void) : Task("TaskInterruptMain") {}
@@ -44,5 +49,47 @@ namespace pf
     this->setAffinity(PF_TASK_MAIN_THREAD);
   }
 
+#if PF_TASK_IO
+  TaskRead::TaskRead(int fd, void *buffer, size_t size) :
+    TaskIO(fd, TaskIO::READ, "TaskRead"),
+    buffer((char*) buffer), size(size), doneSize(0), error(0) {}
+
+  bool TaskRead::process(void) {
+    while (this->doneSize < this->size) {
+      const ssize_t n = read(this->getFD(), buffer + doneSize, size - doneSize);
+      if (n > 0)
+        doneSize += n;
+      else if (n == 0) // end of file
+        break;
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return false;
+      else if (errno != EINTR) {
+        this->error = errno;
+        break;
+      }
+    }
+    return true;
+  }
+
+  TaskWrite::TaskWrite(int fd, const void *buffer, size_t size) :
+    TaskIO(fd, TaskIO::WRITE, "TaskWrite"),
+    buffer((const char*) buffer), size(size), doneSize(0), error(0) {}
+
+  bool TaskWrite::process(void) {
+    while (this->doneSize < this->size) {
+      const ssize_t n = write(this->getFD(), buffer + doneSize, size - doneSize);
+      if (n >= 0)
+        doneSize += n;
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return false;
+      else if (errno != EINTR) {
+        this->error = errno;
+        break;
+      }
+    }
+    return true;
+  }
+#endif /* PF_TASK_IO */
+
 } /* namespace pf */
 
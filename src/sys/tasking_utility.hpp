@@ -20,6 +20,10 @@
 #include "tasking.hpp"
 #include "mutex.hpp"
 
+#include <tuple>
+#include <utility>
+#include <type_traits>
+
 namespace pf
 {
   /*! Make the main thread return to the top-level function */
@@ -56,6 +60,40 @@ namespace pf
     Task *succ;
   };
 
+#if PF_TASK_IO
+  /*! Read size bytes from the descriptor (or less if the end of file is
+   *  reached or on error)
+   */
+  class TaskRead : public TaskIO
+  {
+  public:
+    TaskRead(int fd, void *buffer, size_t size);
+    virtual bool process(void);
+    INLINE size_t getDoneSize(void) const { return this->doneSize; }
+    INLINE int getError(void) const { return this->error; }
+  private:
+    char *buffer;    //!< Where to store the data
+    size_t size;     //!< Number of bytes to read
+    size_t doneSize; //!< Number of bytes already read
+    int error;       //!< errno of the failing read (or 0)
+  };
+
+  /*! Write size bytes to the descriptor (or less on error) */
+  class TaskWrite : public TaskIO
+  {
+  public:
+    TaskWrite(int fd, const void *buffer, size_t size);
+    virtual bool process(void);
+    INLINE size_t getDoneSize(void) const { return this->doneSize; }
+    INLINE int getError(void) const { return this->error; }
+  private:
+    const char *buffer; //!< Data to write
+    size_t size;        //!< Number of bytes to write
+    size_t doneSize;    //!< Number of bytes already written
+    int error;          //!< errno of the failing write (or 0)
+  };
+#endif /* PF_TASK_IO */
+
   /*! Dependency root is the first task that triggers the multiple
    *  dependencies. It includes a mutex protected variable that allows the
    *  start dependencies to be added at any time
@@ -107,22 +145,65 @@ namespace pf
     INLINE TaskInOut(const char *name = NULL) : Task(name) {}
   };
 
-  /*! Encapsulates functor (and anonymous lambda) */
-  template <typename T, typename TaskType = Task>
+  /*! Compile-time list of argument indices (to unpack the stored arguments) */
+  template <size_t... I> struct TaskIndices {};
+  template <size_t N, size_t... I>
+  struct TaskMakeIndices : TaskMakeIndices<N-1, N-1, I...> {};
+  template <size_t... I>
+  struct TaskMakeIndices<0, I...> { typedef TaskIndices<I...> type; };
+
+  /*! Encapsulates functor (and anonymous lambda) and its arguments. Both are
+   *  moved into the task itself such that the task is one allocation. Like
+   *  std::thread, the arguments are given as rvalues to the functor which is
+   *  called once
+   */
+  template <typename T, typename TaskType = Task, typename... Args>
   class TaskFunctor : public TaskType
   {
   public:
-    INLINE TaskFunctor(const T &functor, const char *name = NULL);
+    template <typename U, typename... V>
+    INLINE TaskFunctor(const char *name, U &&functor, V&&... args);
     virtual Task *run(void);
   private:
+    template <size_t... I> INLINE void call(TaskIndices<I...>);
     T functor;
+    std::tuple<Args...> args;
+  };
+
+  /*! Spawn a task from a functor (possibly move-only) and its arguments */
+  template <typename TaskType, typename FunctorType, typename... Args>
+  INLINE TaskType *spawn(const char *name, FunctorType &&functor, Args&&... args) {
+    typedef TaskFunctor<typename std::decay<FunctorType>::type,
+                        TaskType,
+                        typename std::decay<Args>::type...> TaskClass;
+    return PF_NEW(TaskClass, name,
+                  std::forward<FunctorType>(functor),
+                  std::forward<Args>(args)...);
+  }
+
+  /*! Encapsulates the body of a parallelFor */
+  template <typename T>
+  class TaskRangeFunctor : public TaskRange
+  {
+  public:
+    template <typename U>
+    INLINE TaskRangeFunctor(const char *name, size_t begin, size_t end,
+                            size_t grain, U &&body);
+    virtual void run(size_t begin, size_t end);
+  private:
+    T body;
   };
 
-  /*! Spawn a task from a functor */
-  template <typename TaskType, typename FunctorType>
-  TaskType *spawn(const char *name, const FunctorType &functor) {
-    typedef TaskFunctor<FunctorType, TaskType> TaskClass;
-    return PF_NEW(TaskClass, functor, name);
+  /*! Spawn a task that calls body(first, last) over the blocks of
+   *  [begin,end). Blocks have at least grain elements
+   */
+  template <typename BodyType>
+  INLINE TaskRange *parallelFor(const char *name,
+                                size_t begin, size_t end, size_t grain,
+                                BodyType &&body) {
+    typedef TaskRangeFunctor<typename std::decay<BodyType>::type> TaskClass;
+    return PF_NEW(TaskClass, name, begin, end, grain,
+                  std::forward<BodyType>(body));
   }
 
   ///////////////////////////////////////////////////////////////////////////
@@ -169,12 +250,36 @@ namespace pf
     head = newHead;
   }
 
-  template <typename T, typename TaskType>
-  INLINE TaskFunctor<T, TaskType>::TaskFunctor(const T &functor, const char *name) :
-    TaskType(name), functor(functor) {}
+  template <typename T, typename TaskType, typename... Args>
+  template <typename U, typename... V>
+  INLINE TaskFunctor<T, TaskType, Args...>::TaskFunctor(const char *name,
+                                                         U &&functor,
+                                                         V&&... args) :
+    TaskType(name),
+    functor(std::forward<U>(functor)),
+    args(std::forward<V>(args)...) {}
 
-  template <typename T, typename TaskType>
-  Task *TaskFunctor<T, TaskType>::run(void) { functor(); return NULL; }
+  template <typename T, typename TaskType, typename... Args>
+  template <size_t... I>
+  INLINE void TaskFunctor<T, TaskType, Args...>::call(TaskIndices<I...>) {
+    functor(std::move(std::get<I>(args))...);
+  }
+
+  template <typename T, typename TaskType, typename... Args>
+  Task *TaskFunctor<T, TaskType, Args...>::run(void) {
+    this->call(typename TaskMakeIndices<sizeof...(Args)>::type());
+    return NULL;
+  }
+
+  template <typename T>
+  template <typename U>
+  INLINE TaskRangeFunctor<T>::TaskRangeFunctor(const char *name,
+                                               size_t begin, size_t end,
+                                               size_t grain, U &&body) :
+    TaskRange(begin, end, grain, name), body(std::forward<U>(body)) {}
+
+  template <typename T>
+  void TaskRangeFunctor<T>::run(size_t begin, size_t end) { body(begin, end); }
 
 } /* namespace pf */
 
@@ -49,6 +49,10 @@ namespace pf
     if (affinity >= 0) SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1L << affinity));
   }
 
+  int getLogicalThreadOfAffinity(int affinity) {
+    return affinity >= 0 ? affinity % 64 : -1;
+  }
+
   void yield(int time) { Sleep(time); }
 
   void join(thread_t tid) {
@@ -85,17 +89,30 @@ namespace pf
 #ifdef __LINUX__
 namespace pf
 {
+  /*! consecutive affinities first go to different cores */
+  int getLogicalThreadOfAffinity(int affinity)
+  {
+    if (affinity < 0) return -1;
+    const int cpuNum = getNumberOfLogicalThreads();
+    const int wrap = cpuNum/2;
+    affinity = (affinity/2) + wrap*(affinity%2);
+    return affinity < cpuNum ? affinity : -1;
+  }
+
   /*! set affinity of the calling thread */
   void setAffinity(int affinity)
   {
-    int wrap = getNumberOfLogicalThreads()/2;
-    affinity = (affinity/2) + wrap*(affinity%2);
-    if (affinity >= 0 && affinity < 64*64) {
-      uint64 mask[64];
-      for (size_t i=0; i<64; i++) mask[i] = 0;
-      mask[affinity/64]= uint64(1) << (affinity % 64);
-      if (pthread_setaffinity_np(pthread_self(), sizeof(mask), (cpu_set_t*)mask) < 0)
+    const int cpuNum = getNumberOfLogicalThreads();
+    affinity = getLogicalThreadOfAffinity(affinity);
+    if (affinity >= 0) {
+      // The CPU set is sized for the machine (no 1024 CPUs limit)
+      cpu_set_t *mask = CPU_ALLOC(cpuNum);
+      const size_t maskSize = CPU_ALLOC_SIZE(cpuNum);
+      CPU_ZERO_S(maskSize, mask);
+      CPU_SET_S(affinity, maskSize, mask);
+      if (pthread_setaffinity_np(pthread_self(), maskSize, mask) != 0)
         std::cerr << "Thread: cannot set affinity" << std::endl;
+      CPU_FREE(mask);
     }
   }
 }
@@ -123,6 +140,9 @@ namespace pf
         std::cerr << "Thread: cannot set affinity" << std::endl;
     }
   }
+
+  /*! affinities are tags and do not name logical threads */
+  int getLogicalThreadOfAffinity(int affinity) { return -1; }
 }
 #endif
 
@@ -134,6 +154,7 @@ namespace pf
 
 #include <pthread.h>
 #include <sched.h>
+#include <unistd.h>
 
 namespace pf
 {
@@ -33,6 +33,9 @@ namespace pf
   /*! Set affinity of the calling thread */
   void setAffinity(int affinity);
 
+  /*! Logical thread a thread with the given affinity runs on (-1 if unknown) */
+  int getLogicalThreadOfAffinity(int affinity);
+
   /*! The thread calling this function gets yielded for a number of seconds */
   void yield(int time = 0);
 
@@ -16,10 +16,37 @@
 
 #include "sys/tasking.hpp"
 #include "sys/tasking_utility.hpp"
+#include "sys/tasking_coroutine.hpp"
 #include "sys/ref.hpp"
 #include "sys/thread.hpp"
 #include "sys/mutex.hpp"
+#include "sys/condition.hpp"
+#include "sys/futex.hpp"
 #include "sys/sysinfo.hpp"
+#include "sys/bitmap.hpp"
+#include "sys/fiber.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+#if PF_TASK_IO
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#endif /* PF_TASK_IO */
+#if defined(__LINUX__)
+#include <linux/perf_event.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#endif /* defined(__LINUX__) */
 
 #define START_UTEST(TEST_NAME)                          \
 void TEST_NAME(void)                                    \
@@ -134,6 +161,35 @@ START_UTEST(TestTaskSet)
   PF_DELETE_ARRAY(array);
 END_UTEST(TestTaskSet)
 
+///////////////////////////////////////////////////////////////////////////////
+// Same as above with a parallelFor. Each element must be processed exactly
+// once whatever the grain
+///////////////////////////////////////////////////////////////////////////////
+START_UTEST(TestParallelFor)
+  const size_t elemNum = 1 << 20;
+  const size_t grains[] = {1, 64, 4096};
+  uint32 *array = PF_NEW_ARRAY(uint32, elemNum);
+  for (size_t g = 0; g < sizeof(grains) / sizeof(grains[0]); ++g) {
+    for (size_t i = 0; i < elemNum; ++i) array[i] = 0;
+    double t = getSeconds();
+    Task *done = PF_NEW(TaskDone);
+    Task *range = parallelFor("TestParallelFor", 1, elemNum, grains[g],
+      [array](size_t first, size_t last) {
+        for (size_t i = first; i < last; ++i) array[i]++;
+      });
+    range->starts(done);
+    done->scheduled();
+    range->scheduled();
+    TaskingSystemEnter();
+    t = getSeconds() - t;
+    std::cout << "grain " << grains[g] << ": " << t * 1000. << " ms" << std::endl;
+    FATAL_IF(array[0] != 0, "TestParallelFor failed");
+    for (size_t i = 1; i < elemNum; ++i)
+      FATAL_IF(array[i] != 1, "TestParallelFor failed");
+  }
+  PF_DELETE_ARRAY(array);
+END_UTEST(TestParallelFor)
+
 ///////////////////////////////////////////////////////////////////////////////
 // We create a binary tree of tasks here. Each task spawn a two children upto a
 // given maximum level. Then, a atomic value is updated per leaf. In that test,
@@ -305,14 +361,472 @@ START_UTEST(TestAllocator)
 END_UTEST(TestAllocator)
 
 ///////////////////////////////////////////////////////////////////////////////
-// We are making the queue full to make the system recurse to empty it
+// Each thread allocates tasks run (and freed) by the next thread. The freed
+// tasks go back to the allocating threads through the global heap
+///////////////////////////////////////////////////////////////////////////////
+class TaskAllocateRemote : public TaskSet {
+public:
+  TaskAllocateRemote(size_t elemNum) : TaskSet(elemNum, "TaskAllocateRemote") {}
+  virtual void run(size_t elemID) {
+    const uint32 threadNum = TaskingSystemGetThreadNum();
+    const uint32 next = (TaskingSystemGetThreadID() + 1) % threadNum;
+    for (int i = 0; i < allocNum; ++i) {
+      Task *task = PF_NEW(TaskDummy);
+      task->setAffinity(next);
+      task->scheduled();
+    }
+  }
+  enum { allocNum = 1 << 10 };
+};
+
+START_UTEST(TestAllocatorRemote)
+  Task *allocate = PF_NEW(TaskAllocateRemote, 1 << 10);
+  double t = getSeconds();
+  allocate->scheduled();
+  TaskingSystemWaitAll();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+END_UTEST(TestAllocatorRemote)
+
+///////////////////////////////////////////////////////////////////////////////
+// After a burst of tasks, the free chunks must go back to the system
+///////////////////////////////////////////////////////////////////////////////
+START_UTEST(TestReclaim)
+  const uint32 taskNum = 1 << 17;
+  Task **tasks = PF_NEW_ARRAY(Task*, taskNum);
+  TaskingSystemSetTaskMemoryHighWater(~size_t(0));
+  const size_t before = TaskingSystemGetTaskMemory();
+  for (uint32 i = 0; i < taskNum; ++i) tasks[i] = PF_NEW(TaskDummy);
+  for (uint32 i = 0; i < taskNum; ++i) PF_DELETE(tasks[i]);
+  PF_DELETE_ARRAY(tasks);
+  const size_t burst = TaskingSystemGetTaskMemory();
+  TaskingSystemSetTaskMemoryHighWater(0);
+  TaskingSystemWaitAll();
+  const size_t after = TaskingSystemGetTaskMemory();
+  TaskingSystemSetTaskMemoryHighWater(PF_TASK_MEMORY_HIGH_WATER);
+  std::cout << "Task memory: " << before / 1024 << "KB before, "
+            << burst / 1024 << "KB after the burst, "
+            << after / 1024 << "KB after the reclaim" << std::endl;
+  FATAL_IF (after > burst / 2, "TestReclaim failed");
+END_UTEST(TestReclaim)
+
+///////////////////////////////////////////////////////////////////////////////
+// The size classes must not waste more than a quarter of the task size. We
+// check every size and report the worst waste per class. Beyond one page, a
+// task may also take its size rounded up to whole pages
+///////////////////////////////////////////////////////////////////////////////
+template <size_t size>
+class TaskPadded : public Task {
+public:
+  TaskPadded(void) : Task("TaskPadded") {}
+  virtual Task* run(void) { return NULL; }
+  char data[size];
+};
+
+START_UTEST(TestSizeClass)
+  const size_t maxSize = 65520, pageSize = 4096;
+  const size_t headerSize = TaskingSystemGetTaskChunkHeaderSize();
+  size_t size = sizeof(Task);
+  while (size <= maxSize) {
+    // The smallest task of the class wastes the most
+    const size_t sizeClass = TaskingSystemGetTaskSizeClass(size);
+    std::cout << sizeClass << " bytes class: up to "
+              << 100. * (1. - double(size) / sizeClass) << "% waste"
+              << std::endl;
+    for (; size <= sizeClass && size <= maxSize; ++size) {
+      const size_t pages = (headerSize + size + pageSize - 1) & ~(pageSize - 1);
+      const bool wholePages = sizeClass > pageSize && headerSize + sizeClass <= pages;
+      FATAL_IF (TaskingSystemGetTaskSizeClass(size) != sizeClass ||
+                (sizeClass > 1.25 * size && !wholePages), "TestSizeClass failed");
+    }
+  }
+END_UTEST(TestSizeClass)
+
+///////////////////////////////////////////////////////////////////////////////
+// Tasks are cut from large aligned regions. On Linux, we check in
+// /proc/self/smaps that the aligned region around each task is fully mapped
+// and advised for huge pages while the other mappings (like the fiber stacks)
+// are not. We also compare with the same tasks stored in
+// 4KB chunks allocated one by one. Tasks are touched in a random order and the
+// dTLB misses come from the performance counters (when the system lets us
+// read them). The timings are only informative
+///////////////////////////////////////////////////////////////////////////////
+#if defined(__LINUX__)
+/*! Find the mapping containing ptr. Returns false if there is none */
+static bool getMapping(const void *ptr, uintptr_t &first, uintptr_t &last,
+                       bool &hugeAdvised)
+{
+  FILE *file = fopen("/proc/self/smaps", "r");
+  if (file == NULL) return false;
+  char line[512];
+  bool found = false;
+  while (fgets(line, sizeof(line), file)) {
+    unsigned long from, to;
+    if (sscanf(line, "%lx-%lx ", &from, &to) == 2) {
+      if (found) break; // next mapping
+      found = uintptr_t(ptr) >= from && uintptr_t(ptr) < to;
+      first = from;
+      last = to;
+    } else if (found && strncmp(line, "VmFlags:", 8) == 0)
+      hugeAdvised = strstr(line, " hg") != NULL;
+  }
+  fclose(file);
+  return found;
+}
+
+/*! MADV_HUGEPAGE fails when the kernel has no transparent huge pages */
+static bool hasHugePages(void) {
+  FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+  if (file == NULL) return false;
+  char line[128];
+  const bool enabled = fgets(line, sizeof(line), file) != NULL &&
+                       strstr(line, "[never]") == NULL;
+  fclose(file);
+  return enabled;
+}
+
+/*! Each region holding a task is an aligned and fully mapped range */
+static void TestChunkLayoutRegions(char **elems, uint32 elemNum) {
+  const uintptr_t regionSize = PF_TASK_REGION_SIZE;
+  std::vector<uintptr_t> regions(elemNum);
+  for (uint32 i = 0; i < elemNum; ++i)
+    regions[i] = uintptr_t(elems[i]) & ~(regionSize - 1);
+  std::sort(regions.begin(), regions.end());
+  regions.erase(std::unique(regions.begin(), regions.end()), regions.end());
+  const bool huge = hasHugePages();
+  for (size_t i = 0; i < regions.size(); ++i) {
+    uintptr_t first = 0, last = 0;
+    bool hugeAdvised = false;
+    FATAL_IF (!getMapping((void *) regions[i], first, last, hugeAdvised),
+              "TestChunkLayout failed");
+    FATAL_IF (first > regions[i] || last < regions[i] + regionSize,
+              "TestChunkLayout failed");
+    FATAL_IF (huge && !hugeAdvised, "TestChunkLayout failed");
+  }
+  const size_t stackSize = PF_TASK_FIBER_STACK_SIZE;
+  void *stack = mapPages(stackSize, 4096);
+  uintptr_t first = 0, last = 0;
+  bool hugeAdvised = false;
+  FATAL_IF (!getMapping(stack, first, last, hugeAdvised) || hugeAdvised,
+            "TestChunkLayout failed");
+  unmapPages(stack, stackSize);
+  std::cout << regions.size() << " regions, "
+            << (huge ? "advised for huge pages" : "no huge pages")
+            << std::endl;
+}
+#endif /* defined(__LINUX__) */
+
+class DTLBMissCounter {
+public:
+  DTLBMissCounter(void) : fd(-1) {
+#if defined(__LINUX__)
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+#endif /* defined(__LINUX__) */
+  }
+  ~DTLBMissCounter(void) {
+#if defined(__LINUX__)
+    if (fd >= 0) close(fd);
+#endif /* defined(__LINUX__) */
+  }
+  void start(void) {
+#if defined(__LINUX__)
+    if (fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif /* defined(__LINUX__) */
+  }
+  /*! -1 if not available */
+  int64 stop(void) {
+    int64 count = -1;
+#if defined(__LINUX__)
+    if (fd < 0) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) count = -1;
+#endif /* defined(__LINUX__) */
+    return count;
+  }
+private:
+  int fd;
+};
+
+static void TestChunkLayoutWalk(const char *name, char **elems,
+                                const uint32 *order, uint32 elemNum,
+                                double allocTime)
+{
+  DTLBMissCounter counter;
+  volatile char sum = 0;
+  counter.start();
+  double t = getSeconds();
+  for (uint32 i = 0; i < elemNum; ++i) sum = char(sum + *elems[order[i]]);
+  t = getSeconds() - t;
+  const int64 missNum = counter.stop();
+  std::cout << name << ": allocation " << allocTime * 1e9 / elemNum
+            << " ns/task, walk " << t * 1e9 / elemNum << " ns/task, ";
+  if (missNum >= 0)
+    std::cout << double(missNum) / elemNum << " dTLB misses/task" << std::endl;
+  else
+    std::cout << "dTLB misses not available" << std::endl;
+}
+
+START_UTEST(TestChunkLayout)
+  typedef TaskPadded<8> TaskType;
+  const uint32 taskNum = 1 << 18;
+  char **elems = PF_NEW_ARRAY(char*, taskNum);
+  uint32 *order = PF_NEW_ARRAY(uint32, taskNum);
+  for (uint32 i = 0; i < taskNum; ++i) order[i] = i;
+  for (uint32 i = taskNum - 1; i > 0; --i)
+    std::swap(order[i], order[rand() % (i + 1)]);
+
+  // Task allocator
+  double t = getSeconds();
+  for (uint32 i = 0; i < taskNum; ++i) elems[i] = (char *) PF_NEW(TaskType);
+  TestChunkLayoutWalk("regions", elems, order, taskNum, getSeconds() - t);
+#if defined(__LINUX__)
+  TestChunkLayoutRegions(elems, taskNum);
+#endif /* defined(__LINUX__) */
+  for (uint32 i = 0; i < taskNum; ++i) PF_DELETE((TaskType *) elems[i]);
+
+  // One system allocation per 4KB chunk, with the same task size and header
+  const uint32 elemSize = uint32(TaskingSystemGetTaskSizeClass(sizeof(TaskType)));
+  const uint32 headerSize = uint32(TaskingSystemGetTaskChunkHeaderSize());
+  const uint32 perChunk = (4096 - headerSize) / elemSize;
+  const uint32 chunkNum = (taskNum + perChunk - 1) / perChunk;
+  char **chunks = PF_NEW_ARRAY(char*, chunkNum);
+  t = getSeconds();
+  for (uint32 i = 0; i < taskNum; ++i) {
+    if (i % perChunk == 0)
+      chunks[i / perChunk] = (char *) PF_ALIGNED_MALLOC(4096, 4096);
+    elems[i] = chunks[i / perChunk] + headerSize + (i % perChunk) * elemSize;
+    *elems[i] = char(i);
+  }
+  TestChunkLayoutWalk("4KB chunks", elems, order, taskNum, getSeconds() - t);
+  for (uint32 i = 0; i < chunkNum; ++i) PF_ALIGNED_FREE(chunks[i]);
+  PF_DELETE_ARRAY(chunks);
+  PF_DELETE_ARRAY(order);
+  PF_DELETE_ARRAY(elems);
+END_UTEST(TestChunkLayout)
+
+///////////////////////////////////////////////////////////////////////////////
+// NUMA placement on a simulated two-node topology. A task lives on the node of
+// the thread that allocated it. We count the tasks run by a thread of the
+// other node, first with a flat topology (the thieves do not care about the
+// nodes) and then with two nodes. The tasking system is restarted for that.
+// With two nodes, we also force a cross-node load (the main thread, on node 0,
+// produces every task) and check with the steal counters that the thieves of
+// node 0 prefer the victims of their own node
+///////////////////////////////////////////////////////////////////////////////
+static uint32 getTestNode(uint32 threadID, uint32 threadNum) {
+  return threadID * 2 / threadNum; // Consecutive threads share a node
+}
+
+class TaskNumaNode : public Task {
+public:
+  TaskNumaNode(Atomic &remoteNum, uint32 threadNum, uint32 lvl) :
+    Task("TaskNumaNode"), remoteNum(remoteNum), threadNum(threadNum), lvl(lvl),
+    node(getTestNode(TaskingSystemGetThreadID(), threadNum)) {}
+  virtual Task* run(void) {
+    if (getTestNode(TaskingSystemGetThreadID(), threadNum) != node) remoteNum++;
+    if (lvl == maxLevel) return NULL;
+    Task *left  = PF_NEW(TaskNumaNode, remoteNum, threadNum, lvl+1);
+    Task *right = PF_NEW(TaskNumaNode, remoteNum, threadNum, lvl+1);
+    left->ends(this);
+    right->ends(this);
+    left->scheduled();
+    right->scheduled();
+    return NULL;
+  }
+  Atomic &remoteNum;
+  uint32 threadNum, lvl, node;
+};
+
+/*! Node checks from the tasks themselves (only with the simulated nodes) */
+class TaskSetNumaCheck : public TaskSet {
+public:
+  TaskSetNumaCheck(size_t elemNum, uint32 threadNum) :
+    TaskSet(elemNum, "TaskSetNumaCheck"), threadNum(threadNum) {}
+  virtual void run(size_t elemID) {
+    const uint32 expected = getTestNode(TaskingSystemGetThreadID(), threadNum);
+    FATAL_IF (TaskingSystemGetThreadNode() != expected, "TestNuma failed");
+  }
+  uint32 threadNum;
+};
+
+/*! The produced tasks spawn some work in the queue of the thread running them
+ *  so that the thieves also find victims on the other node
+ */
+class TaskNumaLeaf : public Task {
+public:
+  TaskNumaLeaf(uint32 childNum) : Task("TaskNumaLeaf"), childNum(childNum) {}
+  virtual Task* run(void) {
+    volatile uint32 sum = 0;
+    for (uint32 i = 0; i < 8192; ++i) sum = sum + i;
+    for (uint32 i = 0; i < childNum; ++i) PF_NEW(TaskNumaLeaf, 0)->scheduled();
+    return NULL;
+  }
+  uint32 childNum;
+};
+
+/*! All the tasks are produced by the main thread (node 0) */
+static void TestNumaSteal(uint32 nodeNum, uint32 threadNum) {
+  static const uint32 leafNum = 1 << 12;
+  uint64 before[2][2], after[2][2];
+  for (uint32 thief = 0; thief < nodeNum; ++thief)
+  for (uint32 victim = 0; victim < nodeNum; ++victim)
+    before[thief][victim] = TaskingSystemGetStealNum(thief, victim);
+  for (uint32 i = 0; i < leafNum; ++i) PF_NEW(TaskNumaLeaf, 4)->scheduled();
+  TaskingSystemWaitAll();
+  std::cout << "  steals (thief node -> victim node):";
+  for (uint32 thief = 0; thief < nodeNum; ++thief)
+  for (uint32 victim = 0; victim < nodeNum; ++victim) {
+    after[thief][victim] = TaskingSystemGetStealNum(thief, victim);
+    after[thief][victim] -= before[thief][victim];
+    std::cout << " " << thief << "->" << victim << ": " << after[thief][victim];
+  }
+  std::cout << std::endl;
+
+  // Node 0 has a victim (the producer) until the very end so its thieves go
+  // to node 1 only for the last tasks. Node 1 must steal from node 0. We need
+  // at least one thief on each node
+  if (nodeNum != 2 || threadNum < 4) return;
+  FATAL_IF (after[0][1] * 16 > after[0][0], "TestNuma failed");
+  FATAL_IF (after[1][0] == 0, "TestNuma failed");
+}
+
+static void TestNumaRun(const char *name, uint32 nodeNum, uint32 threadNum) {
+  TaskingSystemEnd();
+  TaskingSystemSetNumaNodeNum(nodeNum);
+  TaskingSystemStart(int(threadNum) - 1);
+  if (nodeNum > 1) {
+    PF_NEW(TaskSetNumaCheck, 1024, threadNum)->scheduled();
+    TaskingSystemWaitAll();
+  }
+  Atomic remoteNum(0u);
+  const double t = getSeconds();
+  PF_NEW(TaskNumaNode, remoteNum, threadNum, 0)->scheduled();
+  TaskingSystemWaitAll();
+  const double taskNum = double((2 << maxLevel) - 1);
+  std::cout << name << ": " << (getSeconds() - t) * 1000. << " ms, "
+            << 100. * double(remoteNum) / taskNum
+            << "% of the tasks run on the other node" << std::endl;
+  if (nodeNum == 1 || nodeNum == 2) TestNumaSteal(nodeNum, threadNum);
+}
+
+START_UTEST(TestNuma)
+  const uint32 threadNum = TaskingSystemGetThreadNum();
+  TestNumaRun("flat", 1, threadNum);
+  TestNumaRun("two nodes", 2, threadNum);
+  TestNumaRun("system", 0, threadNum);
+END_UTEST(TestNuma)
+
+///////////////////////////////////////////////////////////////////////////////
+// Tasks larger than 1KB (pooled up to 64KB and directly allocated beyond)
+///////////////////////////////////////////////////////////////////////////////
+template <size_t size>
+class TaskBig : public Task {
+public:
+  TaskBig(Atomic &counter) : Task("TaskBig"), counter(counter) {
+    for (size_t i = 0; i < size; ++i) data[i] = char(i);
+  }
+  virtual Task* run(void) {
+    for (size_t i = 0; i < size; ++i)
+      if (data[i] != char(i)) return NULL;
+    counter++;
+    return NULL;
+  }
+  Atomic &counter;
+  char data[size];
+};
+
+class TaskSpawnBig : public TaskSet {
+public:
+  TaskSpawnBig(size_t elemNum, Atomic &counter) :
+    TaskSet(elemNum, "TaskSpawnBig"), counter(counter) {}
+  virtual void run(size_t elemID) {
+    Task *task = NULL;
+    switch (elemID % 4) {
+      case 0: task = PF_NEW(TaskBig<1500>, counter); break;
+      case 1: task = PF_NEW(TaskBig<5000>, counter); break;
+      case 2: task = PF_NEW(TaskBig<40000>, counter); break;
+      case 3: task = PF_NEW(TaskBig<200000>, counter); break;
+    }
+    task->scheduled();
+  }
+  Atomic &counter;
+};
+
+START_UTEST(TestBigTask)
+  const size_t taskNum = 1 << 10;
+  Atomic counter(0u);
+  Task *spawn = PF_NEW(TaskSpawnBig, taskNum, counter);
+  double t = getSeconds();
+  spawn->scheduled();
+  TaskingSystemWaitAll();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  FATAL_IF (counter != taskNum, "TestBigTask failed");
+END_UTEST(TestBigTask)
+
+///////////////////////////////////////////////////////////////////////////////
+// Lambda tasks move their captures and arguments into the task. We count the
+// copies of a big capture and pass a move-only argument
 ///////////////////////////////////////////////////////////////////////////////
+struct SpawnPayload {
+  SpawnPayload(void) : data(1024, 1) {}
+  SpawnPayload(const SpawnPayload &other) : data(other.data) { copyNum++; }
+  SpawnPayload(SpawnPayload &&other) : data(std::move(other.data)) {}
+  std::vector<int> data;
+  static Atomic copyNum;
+};
+Atomic SpawnPayload::copyNum(0u);
+
+START_UTEST(TestSpawn)
+  const size_t taskNum = 1 << 14;
+  Atomic counter(0u);
+  SpawnPayload::copyNum = 0;
+  double t = getSeconds();
+  for (size_t i = 0; i < taskNum; ++i) {
+    SpawnPayload payload;
+    std::unique_ptr<int> one(new int(1));
+    Task *task = spawn<Task>("TaskSpawn",
+      [payload, &counter](std::unique_ptr<int> value) {
+        counter += uint32(payload.data[0] * *value);
+      }, std::move(one));
+    task->scheduled();
+  }
+  TaskingSystemWaitAll();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  FATAL_IF (counter != taskNum, "TestSpawn failed");
+  // The lambda capture itself is the only copy
+  FATAL_IF (SpawnPayload::copyNum != taskNum, "TestSpawn copied the captures");
+END_UTEST(TestSpawn)
+
+///////////////////////////////////////////////////////////////////////////////
+// We spawn a lot of tasks at once. Since the queues grow, the system should
+// never have to recurse to empty them: no task may run inline, i.e. on the
+// stack of another task of the same thread
+///////////////////////////////////////////////////////////////////////////////
+static uint32 fullDepth[1024];
+static Atomic fullMaxDepth(0u);
+
 class TaskFull : public Task {
 public:
   enum { taskToSpawn = 1u << 16u };
   TaskFull(const char *name, Atomic &counter, int lvl = 0) :
     Task(name), counter(counter), lvl(lvl) {}
   virtual Task* run(void) {
+    const uint32 threadID = TaskingSystemGetThreadID();
+    const uint32 depth = fullDepth[threadID]++;
+    if (depth > fullMaxDepth) fullMaxDepth = depth;
     if (lvl == 0)
       for (size_t i = 0; i < taskToSpawn; ++i) {
         Task *task = PF_NEW(TaskFull, "TaskFullLvl1", counter, 1);
@@ -321,6 +835,7 @@ public:
       }
     else
       counter++;
+    fullDepth[threadID]--;
     return NULL;
   }
   Atomic &counter;
@@ -328,7 +843,9 @@ public:
 };
 
 START_UTEST(TestFullQueue)
+  STATIC_ASSERT(TaskFull::taskToSpawn > PF_TASK_QUEUE_INIT_SIZE);
   Atomic counter(0u);
+  fullMaxDepth = 0;
   double t = getSeconds();
   Task *done = PF_NEW(TaskDone);
   for (size_t i = 0; i < 64; ++i) {
@@ -341,10 +858,83 @@ START_UTEST(TestFullQueue)
   t = getSeconds() - t;
   std::cout << t * 1000. << " ms" << std::endl;
   FATAL_IF (counter != 64 * TaskFull::taskToSpawn, "TestFullQueue failed");
+  FATAL_IF (fullMaxDepth != 0u, "TestFullQueue ran tasks inline");
 END_UTEST(TestFullQueue)
 
 ///////////////////////////////////////////////////////////////////////////////
-// We spawn a lot of affinity jobs to saturate the affinity queues
+// A thief takes half of the victim queue (up to PF_TASK_STEAL_MAX tasks) at
+// once. With one worker, main fills its queue while the worker is blocked and
+// then only waits. The worker steals everything from main, so we know exactly
+// how many steals it needs
+///////////////////////////////////////////////////////////////////////////////
+class TaskStealBlocker : public Task {
+public:
+  TaskStealBlocker(Atomic &started, Atomic &released) :
+    Task("TaskStealBlocker"), started(started), released(released) {}
+  virtual Task* run(void) {
+    started++;
+    while (released == 0u) {}
+    return NULL;
+  }
+  Atomic &started, &released;
+};
+
+class TaskStealCount : public Task {
+public:
+  TaskStealCount(Atomic &counter) : Task("TaskStealCount"), counter(counter) {}
+  virtual Task* run(void) { counter++; return NULL; }
+  Atomic &counter;
+};
+
+START_UTEST(TestStealHalf)
+  const uint32 threadNum = TaskingSystemGetThreadNum();
+  const uint32 taskNum = 1024;
+  TaskingSystemEnd();
+  TaskingSystemSetNumaNodeNum(1);
+  TaskingSystemStart(1);
+
+  // The worker steals the blocker (one task in the queue)
+  Atomic started(0u), released(0u), counter(0u);
+  const uint64 stealNum = TaskingSystemGetStealNum(0, 0);
+  PF_NEW(TaskStealBlocker, started, released)->scheduled();
+  while (started == 0u) {}
+  for (uint32 i = 0; i < taskNum; ++i)
+    PF_NEW(TaskStealCount, counter)->scheduled();
+  released++;
+  while (counter != taskNum) {}
+  const uint64 stolenNum = TaskingSystemGetStealNum(0, 0) - stealNum;
+
+  // Replay the steals: half of the remaining tasks, up to PF_TASK_STEAL_MAX
+  uint64 expected = 1;
+  for (uint32 left = taskNum; left != 0; ++expected)
+    left -= std::min(left - left / 2, uint32(PF_TASK_STEAL_MAX));
+  std::cout << taskNum << " tasks stolen in " << stolenNum - 1
+            << " steals" << std::endl;
+  FATAL_IF (stolenNum != expected, "TestStealHalf failed");
+  TaskingSystemEnd();
+  TaskingSystemSetNumaNodeNum(0);
+  TaskingSystemStart(int(threadNum) - 1);
+END_UTEST(TestStealHalf)
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait for all tasks without any task to interrupt the main thread
+///////////////////////////////////////////////////////////////////////////////
+START_UTEST(TestWaitAll)
+  Atomic counter(0u);
+  double t = getSeconds();
+  for (size_t i = 0; i < 16; ++i) {
+    Task *task = PF_NEW(TaskFull, "TaskFull", counter);
+    task->scheduled();
+  }
+  TaskingSystemWaitAll();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  FATAL_IF (counter != 16 * TaskFull::taskToSpawn, "TestWaitAll failed");
+END_UTEST(TestWaitAll)
+
+///////////////////////////////////////////////////////////////////////////////
+// We spawn a lot of affinity jobs from all the threads at once. The affinity
+// queues have no capacity limit so producers never have to wait
 ///////////////////////////////////////////////////////////////////////////////
 class TaskAffinity : public Task {
 public:
@@ -386,10 +976,128 @@ START_UTEST(TestAffinity)
     t = getSeconds() - t;
     std::cout << t * 1000. << " ms" << std::endl;
     std::cout << counter << std::endl;
-    FATAL_IF (counter != batchNum * TaskAffinity::taskToSpawn, "TestAffinity failed");
+    FATAL_IF (counter != uint32(batchNum) * TaskAffinity::taskToSpawn, "TestAffinity failed");
   }
 END_UTEST(TestAffinity)
 
+///////////////////////////////////////////////////////////////////////////////
+// Threads outside the tasking system allocate and schedule tasks. We measure
+// the injection throughput with 1, 2 and 4 producers. Some tasks go to an
+// affinity queue and some others are released by their producer
+///////////////////////////////////////////////////////////////////////////////
+class TaskForeign : public Task {
+public:
+  TaskForeign(Atomic &counter) : Task("TaskForeign"), counter(counter) {}
+  virtual Task *run(void) {
+    counter++;
+    return NULL;
+  }
+  Atomic &counter;
+};
+
+struct ForeignProducer {
+  Atomic *counter;
+  uint32 taskNum;
+};
+
+static void foreignProducer(ForeignProducer *producer) {
+  const uint32 threadNum = TaskingSystemGetThreadNum();
+  FATAL_IF (TaskingSystemGetThreadID() != PF_TASK_FOREIGN_THREAD, "TestForeign failed");
+  Ref<Task> kept[16];
+  for (uint32 i = 0; i < producer->taskNum; ++i) {
+    Task *task = PF_NEW(TaskForeign, *producer->counter);
+    if (i % 1024 == 0) kept[(i / 1024) % 16] = task;
+    if (i % 4096 == 0) task->setAffinity(i % threadNum);
+    task->scheduled();
+  }
+}
+
+START_UTEST(TestForeign)
+  enum { maxProducerNum = 4 };
+  const uint32 taskNum = 1 << 18;
+  for (uint32 producerNum = 1; producerNum <= maxProducerNum; producerNum *= 2) {
+    Atomic counter(0u);
+    ForeignProducer producer = {&counter, taskNum / producerNum};
+    thread_t threads[maxProducerNum];
+    double t = getSeconds();
+    for (uint32 i = 0; i < producerNum; ++i)
+      threads[i] = createThread((thread_func) foreignProducer, &producer);
+    for (uint32 i = 0; i < producerNum; ++i)
+      join(threads[i]);
+    TaskingSystemWaitAll();
+    t = getSeconds() - t;
+    std::cout << producerNum << " producer(s): "
+              << double(taskNum) / t * 1e-6 << " million tasks/s" << std::endl;
+    FATAL_IF (counter != taskNum, "TestForeign failed");
+  }
+END_UTEST(TestForeign)
+
+///////////////////////////////////////////////////////////////////////////////
+// A foreign thread delays a task that signals an event. A suspendable task
+// waits for it and signals another event the foreign thread blocks on
+///////////////////////////////////////////////////////////////////////////////
+class TaskForeignTimer : public Task {
+public:
+  TaskForeignTimer(TaskEvent &event, double &firedAt) :
+    Task("TaskForeignTimer"), event(event), firedAt(firedAt) {}
+  virtual Task *run(void) {
+    firedAt = getSeconds();
+    event.signal();
+    return NULL;
+  }
+  TaskEvent &event;
+  double &firedAt;
+};
+
+class TaskForeignEcho : public Task {
+public:
+  TaskForeignEcho(TaskEvent &ping, TaskEvent &pong) :
+    Task("TaskForeignEcho"), ping(ping), pong(pong)
+  { this->setSuspendable(true); }
+  virtual Task *run(void) {
+    ping.wait();
+    pong.signal();
+    return NULL;
+  }
+  TaskEvent &ping, &pong;
+};
+
+struct ForeignWaiter {
+  enum { roundNum = 16 };
+  TaskEvent ping[roundNum], pong[roundNum];
+  Atomic error, done;
+};
+
+static void foreignWaiter(ForeignWaiter *waiter) {
+  for (uint32 i = 0; i < ForeignWaiter::roundNum; ++i) {
+    double firedAt = 0.;
+    Task *echo = PF_NEW(TaskForeignEcho, waiter->ping[i], waiter->pong[i]);
+    Task *timer = PF_NEW(TaskForeignTimer, waiter->ping[i], firedAt);
+    echo->scheduled();
+    const double t = getSeconds();
+    timer->scheduledAfter(1 + i % 3);
+    waiter->pong[i].wait();
+    if (firedAt - t < 1e-3) waiter->error++;
+  }
+  waiter->done++;
+}
+
+START_UTEST(TestForeignEvent)
+  ForeignWaiter *waiter = PF_NEW(ForeignWaiter);
+  waiter->error = 0;
+  waiter->done = 0;
+  thread_t thread = createThread((thread_func) foreignWaiter, waiter);
+  // Without any worker, we must run the tasks of the foreign thread
+  while (waiter->done == 0) {
+    TaskingSystemWaitAll();
+    yield();
+  }
+  join(thread);
+  TaskingSystemWaitAll();
+  FATAL_IF (waiter->error != 0, "TestForeignEvent failed");
+  PF_DELETE(waiter);
+END_UTEST(TestForeignEvent)
+
 ///////////////////////////////////////////////////////////////////////////////
 // Exponential Fibonnaci to stress the task spawning and the completions
 ///////////////////////////////////////////////////////////////////////////////
@@ -468,6 +1176,497 @@ START_UTEST(TestFibo)
 }
 END_UTEST(TestFibo)
 
+///////////////////////////////////////////////////////////////////////////////
+// Same as above but the tasks directly wait for their children
+///////////////////////////////////////////////////////////////////////////////
+class TaskFiboWait : public Task {
+public:
+  TaskFiboWait(uint64 rank, uint64 *result) :
+    Task("TaskFiboWait"), rank(rank), result(result) {}
+  virtual Task* run(void) {
+    fiboNum++;
+    if (rank < 2) {
+      *result = rank;
+      return NULL;
+    }
+    uint64 sumLeft, sumRight;
+    Ref<Task> left = PF_NEW(TaskFiboWait, rank-1, &sumLeft);
+    Ref<Task> right = PF_NEW(TaskFiboWait, rank-2, &sumRight);
+    left->scheduled();
+    right->scheduled();
+    TaskingSystemWait(right);
+    TaskingSystemWait(left);
+    *result = sumLeft + sumRight;
+    return NULL;
+  }
+  uint64 rank;
+  uint64 *result;
+};
+
+START_UTEST(TestFiboWait)
+{
+  const uint64 rank = rand() % 24;
+  uint64 sum;
+  double t = getSeconds();
+  fiboNum = 0u;
+  Ref<Task> fibo = PF_NEW(TaskFiboWait, rank, &sum);
+  Task *done = PF_NEW(TaskDone);
+  fibo->starts(done);
+  fibo->scheduled();
+  done->scheduled();
+  TaskingSystemEnter();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  std::cout << "Fibonacci Task Num: "<< fiboNum << std::endl;
+  FATAL_IF (sum != fiboLinear(rank), "TestFiboWait failed");
+}
+END_UTEST(TestFiboWait)
+
+///////////////////////////////////////////////////////////////////////////////
+// Each task waits for a delayed child. In the mean time, the waiting thread
+// runs other tasks that wait too, so the waits nest. The nesting is bounded.
+// We give enough tasks to reach the bound on some threads but never on all of
+// them since some threads must still fire the timers
+///////////////////////////////////////////////////////////////////////////////
+static uint32 waitDepth[1024];
+static Atomic waitMaxDepth(0u);
+
+class TaskWaitChild : public Task {
+public:
+  TaskWaitChild(void) : Task("TaskWaitChild") {}
+  virtual Task* run(void) { return NULL; }
+};
+
+class TaskWaitNested : public Task {
+public:
+  TaskWaitNested(Atomic &counter) : Task("TaskWaitNested"), counter(counter) {}
+  virtual Task* run(void) {
+    const uint32 threadID = TaskingSystemGetThreadID();
+    const uint32 depth = waitDepth[threadID]++;
+    if (depth > waitMaxDepth) waitMaxDepth = depth;
+    Ref<Task> child = PF_NEW(TaskWaitChild);
+    child->scheduledAfter(1);
+    TaskingSystemWait(child);
+    waitDepth[threadID]--;
+    counter++;
+    return NULL;
+  }
+  Atomic &counter;
+};
+
+START_UTEST(TestWaitNested)
+  const uint32 taskNum = TaskingSystemGetThreadNum() * PF_TASK_WAIT_MAX_DEPTH / 2;
+  Atomic counter(0u);
+  waitMaxDepth = 0;
+  for (uint32 i = 0; i < taskNum; ++i) PF_NEW(TaskWaitNested, counter)->scheduled();
+  TaskingSystemWaitAll();
+  std::cout << "Maximum depth: " << waitMaxDepth << std::endl;
+  FATAL_IF (counter != taskNum, "TestWaitNested failed");
+  FATAL_IF (waitMaxDepth > PF_TASK_WAIT_MAX_DEPTH, "TestWaitNested failed");
+END_UTEST(TestWaitNested)
+
+#if PF_TASK_COROUTINE
+///////////////////////////////////////////////////////////////////////////////
+// Same Fibonacci with coroutines. The continuation is straight-line code
+///////////////////////////////////////////////////////////////////////////////
+static Ref<TaskCoroutine> fiboCoroutine(uint64 rank, uint64 *result) {
+  fiboNum++;
+  if (rank < 2) {
+    *result = rank;
+    co_return;
+  }
+  uint64 sumLeft, sumRight;
+  co_await TaskAll(fiboCoroutine(rank-1, &sumLeft),
+                   fiboCoroutine(rank-2, &sumRight));
+  *result = sumLeft + sumRight;
+}
+
+START_UTEST(TestFiboCoroutine)
+{
+  const uint64 rank = rand() % 24;
+  uint64 sum;
+  double t = getSeconds();
+  fiboNum = 0u;
+  Ref<TaskCoroutine> fibo = fiboCoroutine(rank, &sum);
+  fibo->scheduled();
+  TaskingSystemWait(fibo.ptr);
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  std::cout << "Fibonacci Task Num: "<< fiboNum << std::endl;
+  FATAL_IF (sum != fiboLinear(rank), "TestFiboCoroutine failed");
+}
+END_UTEST(TestFiboCoroutine)
+#endif /* PF_TASK_COROUTINE */
+
+///////////////////////////////////////////////////////////////////////////////
+// Many suspendable tasks wait for an event signaled by the previous one. They
+// are all suspended at once and resumed one after the other by any thread. A
+// regular task also waits for the last event (it only helps)
+///////////////////////////////////////////////////////////////////////////////
+class TaskSuspend : public Task {
+public:
+  TaskSuspend(TaskEvent *events, uint32 id, Atomic &order, Atomic &error) :
+    Task("TaskSuspend"), events(events), id(id), order(order), error(error)
+  { this->setSuspendable(true); }
+  virtual Task* run(void) {
+    events[id].wait();
+    if (order++ != id) error++;
+    events[id+1].signal();
+    return NULL;
+  }
+  TaskEvent *events;
+  uint32 id;
+  Atomic &order, &error;
+};
+
+class TaskWaitEvent : public Task {
+public:
+  TaskWaitEvent(TaskEvent &event, Atomic &order) :
+    Task("TaskWaitEvent"), event(event), order(order) {}
+  virtual Task* run(void) {
+    event.wait();
+    order++;
+    return NULL;
+  }
+  TaskEvent &event;
+  Atomic &order;
+};
+
+START_UTEST(TestFiber)
+{
+  const uint32 taskNum = 1024;
+  TaskEvent *events = PF_NEW_ARRAY(TaskEvent, taskNum + 1);
+  Atomic order(0u), error(0u);
+  double t = getSeconds();
+  Task *waiter = PF_NEW(TaskWaitEvent, events[taskNum], order);
+  waiter->scheduled();
+  for (uint32 i = 0; i < taskNum; ++i) {
+    Task *task = PF_NEW(TaskSuspend, events, taskNum - i - 1, order, error);
+    task->scheduled();
+  }
+  events[0].signal();
+  TaskingSystemWaitAll();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  FATAL_IF (error != 0 || order != taskNum + 1, "TestFiber failed");
+  PF_DELETE_ARRAY(events);
+}
+END_UTEST(TestFiber)
+
+///////////////////////////////////////////////////////////////////////////////
+// Suspendable tasks wait for their child. Neither the wait nor
+// TaskingSystemRunSomething may run the child on top of the small fiber stack
+// of the waiting task. The child compares its stack with the one of its parent
+///////////////////////////////////////////////////////////////////////////////
+class TaskFiberChild : public Task {
+public:
+  TaskFiberChild(uintptr_t parentStack, Atomic &nestedNum) :
+    Task("TaskFiberChild"), parentStack(parentStack), nestedNum(nestedNum) {}
+  virtual Task* run(void) {
+    char local = 0;
+    const uintptr_t stack = uintptr_t(&local);
+    if (stack < parentStack && parentStack - stack < PF_TASK_FIBER_STACK_SIZE)
+      nestedNum++;
+    return NULL;
+  }
+  uintptr_t parentStack;
+  Atomic &nestedNum;
+};
+
+class TaskFiberWaiter : public Task {
+public:
+  TaskFiberWaiter(Atomic &nestedNum, Atomic &doneNum) :
+    Task("TaskFiberWaiter"), nestedNum(nestedNum), doneNum(doneNum)
+  { this->setSuspendable(true); }
+  virtual Task* run(void) {
+    char local = 0;
+    Ref<Task> child = PF_NEW(TaskFiberChild, uintptr_t(&local), nestedNum);
+    child->scheduled();
+    if (TaskingSystemRunSomething()) nestedNum++;
+    TaskingSystemWait(child);
+    doneNum++;
+    return NULL;
+  }
+  Atomic &nestedNum, &doneNum;
+};
+
+START_UTEST(TestFiberWait)
+{
+  const uint32 taskNum = 1024;
+  Atomic nestedNum(0u), doneNum(0u);
+  for (uint32 i = 0; i < taskNum; ++i)
+    PF_NEW(TaskFiberWaiter, nestedNum, doneNum)->scheduled();
+  TaskingSystemWaitAll();
+  FATAL_IF (doneNum != taskNum, "TestFiberWait failed");
+  FATAL_IF (nestedNum != 0u, "TestFiberWait ran a task on a fiber stack");
+}
+END_UTEST(TestFiberWait)
+
+#if defined(__LINUX__)
+///////////////////////////////////////////////////////////////////////////////
+// A fiber that overflows its stack must hit the guard page. We do it in a
+// child process whose fault handler checks that the fault is on a protected
+// page right below the stack
+///////////////////////////////////////////////////////////////////////////////
+enum { FIBER_GUARD_HIT = 42 };
+static char * volatile fiberTop = NULL;
+
+static uint32 fiberRecurse(uint32 depth) {
+  volatile char frame[256];
+  frame[0] = char(depth);
+  if (depth == 0) return frame[0];
+  return fiberRecurse(depth - 1) + frame[0];
+}
+
+static void fiberOverflow(void *) {
+  char top;
+  fiberTop = &top;
+  fiberRecurse(1 << 20); // Way more than the stack
+  _exit(0);
+}
+
+// The guard page is mapped but inaccessible (SEGV_ACCERR). Unmapped memory
+// would give SEGV_MAPERR
+static void fiberFault(int, siginfo_t *info, void *) {
+  const size_t distance = size_t(fiberTop - (char *) info->si_addr);
+  const bool guard = info->si_code == SEGV_ACCERR &&
+                     distance <= PF_TASK_FIBER_STACK_SIZE + 2 * PAGE_BYTES;
+  _exit(guard ? FIBER_GUARD_HIT : 1);
+}
+
+START_UTEST(TestFiberGuard)
+  const pid_t pid = fork();
+  FATAL_IF (pid < 0, "TestFiberGuard failed");
+  if (pid == 0) {
+    static char altStack[64 * 1024];
+    stack_t ss;
+    ss.ss_sp = altStack;
+    ss.ss_size = sizeof(altStack);
+    ss.ss_flags = 0;
+    sigaltstack(&ss, NULL);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = fiberFault;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigaction(SIGSEGV, &action, NULL);
+    Fiber thread;
+    Fiber overflow((fiber_func) fiberOverflow, NULL, PF_TASK_FIBER_STACK_SIZE);
+    thread.switchTo(overflow);
+    _exit(0);
+  }
+  int status = 0;
+  FATAL_IF (waitpid(pid, &status, 0) != pid, "TestFiberGuard failed");
+  FATAL_IF (!WIFEXITED(status) || WEXITSTATUS(status) != FIBER_GUARD_HIT,
+            "TestFiberGuard failed");
+END_UTEST(TestFiberGuard)
+#endif /* defined(__LINUX__) */
+
+///////////////////////////////////////////////////////////////////////////////
+// Tasks poll a "resource" (here, a timer that simulates an IO latency) and run
+// other tasks in between. These ones poll too so the nested calls must be
+// bounded. The depth of a task is the number of polling tasks below it on the
+// stack of its thread, i.e. the number of nested TaskingSystemRunSomething
+// calls that run it
+///////////////////////////////////////////////////////////////////////////////
+static uint32 runSomethingDepth[1024];
+static Atomic runSomethingMaxDepth(0u);
+
+class TaskPoll : public Task {
+public:
+  TaskPoll(Atomic &counter) : Task("TaskPoll"), counter(counter) {}
+  virtual Task* run(void) {
+    const uint32 threadID = TaskingSystemGetThreadID();
+    const uint32 depth = runSomethingDepth[threadID]++;
+    if (depth > runSomethingMaxDepth) runSomethingMaxDepth = depth;
+    const double latency = 50e-6;
+    const double end = getSeconds() + latency;
+    while (getSeconds() < end) TaskingSystemRunSomething();
+    runSomethingDepth[threadID]--;
+    counter++;
+    return NULL;
+  }
+  Atomic &counter;
+};
+
+START_UTEST(TestRunSomething)
+{
+  const uint32 taskNum = 1024;
+  Atomic counter(0u);
+  runSomethingMaxDepth = 0;
+  double t = getSeconds();
+  for (uint32 i = 0; i < taskNum; ++i) {
+    Task *task = PF_NEW(TaskPoll, counter);
+    task->scheduled();
+  }
+  TaskingSystemWaitAll();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  std::cout << "Maximum depth: " << runSomethingMaxDepth << std::endl;
+  FATAL_IF (counter != taskNum, "TestRunSomething failed");
+  FATAL_IF (runSomethingMaxDepth > PF_TASK_RUN_SOMETHING_MAX_DEPTH,
+            "TestRunSomething failed");
+}
+END_UTEST(TestRunSomething)
+
+///////////////////////////////////////////////////////////////////////////////
+// Delayed and periodic tasks. A task must never start before its deadline
+///////////////////////////////////////////////////////////////////////////////
+static Atomic timerEarlyNum(0u);
+static double timerMaxLateness = 0., timerTotalLateness = 0.;
+static MutexSys timerMutex;
+
+static void recordLateness(double expected) {
+  const double lateness = getSeconds() - expected;
+  if (lateness < 0.) timerEarlyNum++;
+  Lock<MutexSys> lock(timerMutex);
+  timerTotalLateness += lateness;
+  if (lateness > timerMaxLateness) timerMaxLateness = lateness;
+}
+
+class TaskDelayed : public Task {
+public:
+  TaskDelayed(double expected) : Task("TaskDelayed"), expected(expected) {}
+  virtual Task* run(void) { recordLateness(expected); return NULL; }
+  double expected;
+};
+
+class TaskPeriodic : public Task {
+public:
+  TaskPeriodic(uint32 period, uint32 runNum, Atomic &counter) :
+    Task("TaskPeriodic"), period(period), runNum(runNum), counter(counter) {}
+  virtual Task* run(void) {
+    if (counter++ != 0) recordLateness(expected);
+    if (--runNum == 0) return NULL;
+    expected = getSeconds() + period * 1e-3;
+    this->runAgainAfter(period);
+    return NULL;
+  }
+  double expected;
+  uint32 period, runNum;
+  Atomic &counter;
+};
+
+START_UTEST(TestTimer)
+{
+  const uint32 taskNum = 256, periodicNum = 10;
+  Atomic counter(0u);
+  timerEarlyNum = 0;
+  timerMaxLateness = timerTotalLateness = 0.;
+  for (uint32 i = 0; i < taskNum; ++i) {
+    const uint32 ms = 1 + rand() % 20;
+    Task *task = PF_NEW(TaskDelayed, getSeconds() + ms * 1e-3);
+    task->scheduledAfter(ms);
+  }
+  Task *periodic = PF_NEW(TaskPeriodic, 2, periodicNum, counter);
+  periodic->scheduled();
+  TaskingSystemWaitAll();
+  const uint32 measuredNum = taskNum + periodicNum - 1;
+  std::cout << "Mean lateness: " << timerTotalLateness / measuredNum * 1e3
+            << " ms, maximum: " << timerMaxLateness * 1e3 << " ms" << std::endl;
+  FATAL_IF (timerEarlyNum != 0u, "TestTimer failed");
+  FATAL_IF (counter != periodicNum, "TestTimer failed");
+}
+END_UTEST(TestTimer)
+
+#if PF_TASK_IO
+///////////////////////////////////////////////////////////////////////////////
+// I/O tasks with local pipes, sockets and files. The pipe is larger than the
+// kernel buffer so that both the reader and the writer wait in the reactor. On
+// each end of the socket, a reader and a writer wait at the same time. All the
+// descriptors are opened non-blocking
+///////////////////////////////////////////////////////////////////////////////
+class TaskCheckIO : public Task {
+public:
+  TaskCheckIO(TaskRead *read, const char *buffer, const char *ref,
+              size_t size, Atomic &counter) :
+    Task("TaskCheckIO"), read(read), buffer(buffer), ref(ref),
+    size(size), counter(counter) {}
+  virtual Task* run(void) {
+    FATAL_IF (read->getError() != 0, "TestIO failed");
+    FATAL_IF (read->getDoneSize() != size, "TestIO failed");
+    FATAL_IF (memcmp(buffer, ref, size) != 0, "TestIO failed");
+    counter++;
+    this->read = NULL; // The reader holds us until it dies
+    return NULL;
+  }
+  Ref<TaskRead> read;
+  const char *buffer, *ref;
+  size_t size;
+  Atomic &counter;
+};
+
+START_UTEST(TestIO)
+{
+  const size_t size = 1 << 20;
+  char *ref = PF_NEW_ARRAY(char, size);
+  char *fromPipe = PF_NEW_ARRAY(char, size);
+  char *fromFile = PF_NEW_ARRAY(char, size);
+  char *fromSockets[2] = {PF_NEW_ARRAY(char, size), PF_NEW_ARRAY(char, size)};
+  for (size_t i = 0; i < size; ++i) ref[i] = char(rand());
+  Atomic counter(0u);
+
+  // Pipe: the reader is scheduled first and waits for the writer
+  int fds[2];
+  FATAL_IF (pipe2(fds, O_NONBLOCK) != 0, "TestIO failed");
+  double t = getSeconds();
+  TaskRead *readPipe = PF_NEW(TaskRead, fds[0], fromPipe, size);
+  TaskCheckIO *checkPipe =
+    PF_NEW(TaskCheckIO, readPipe, fromPipe, ref, size, counter);
+  readPipe->starts(checkPipe);
+  checkPipe->scheduled();
+  readPipe->scheduled();
+  TaskWrite *writePipe = PF_NEW(TaskWrite, fds[1], ref, size);
+  writePipe->scheduled();
+
+  // Socket: both ends send and receive at once
+  int sockets[2];
+  FATAL_IF (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sockets) != 0,
+            "TestIO failed");
+  for (int i = 0; i < 2; ++i) {
+    TaskRead *readSocket = PF_NEW(TaskRead, sockets[i], fromSockets[i], size);
+    TaskCheckIO *checkSocket =
+      PF_NEW(TaskCheckIO, readSocket, fromSockets[i], ref, size, counter);
+    readSocket->starts(checkSocket);
+    checkSocket->scheduled();
+    readSocket->scheduled();
+    TaskWrite *writeSocket = PF_NEW(TaskWrite, sockets[i], ref, size);
+    writeSocket->scheduled();
+  }
+
+  // File: it is always ready
+  FILE *file = tmpfile();
+  FATAL_IF (file == NULL, "TestIO failed");
+  FATAL_IF (fwrite(ref, 1, size, file) != size, "TestIO failed");
+  fflush(file);
+  rewind(file);
+  const int flags = fcntl(fileno(file), F_GETFL);
+  FATAL_IF (fcntl(fileno(file), F_SETFL, flags | O_NONBLOCK) != 0,
+            "TestIO failed");
+  TaskRead *readFile = PF_NEW(TaskRead, fileno(file), fromFile, size);
+  TaskCheckIO *checkFile =
+    PF_NEW(TaskCheckIO, readFile, fromFile, ref, size, counter);
+  readFile->starts(checkFile);
+  checkFile->scheduled();
+  readFile->scheduled();
+
+  TaskingSystemWaitAll();
+  t = getSeconds() - t;
+  std::cout << t * 1000. << " ms" << std::endl;
+  FATAL_IF (counter != 4, "TestIO failed");
+  close(fds[0]);
+  close(fds[1]);
+  close(sockets[0]);
+  close(sockets[1]);
+  PF_DELETE_ARRAY(fromSockets[0]);
+  PF_DELETE_ARRAY(fromSockets[1]);
+  fclose(file);
+  PF_DELETE_ARRAY(fromFile);
+  PF_DELETE_ARRAY(fromPipe);
+  PF_DELETE_ARRAY(ref);
+}
+END_UTEST(TestIO)
+#endif /* PF_TASK_IO */
+
 ///////////////////////////////////////////////////////////////////////////////
 // Task with multiple dependencies
 ///////////////////////////////////////////////////////////////////////////////
@@ -625,6 +1824,153 @@ START_UTEST(TestLockUnlock)
 }
 END_UTEST(TestLockUnlock)
 
+///////////////////////////////////////////////////////////////////////////////
+// Measure how long it takes to wake up a sleeping worker. As a baseline, we
+// also measure the parking primitive alone: the futex the workers sleep on and
+// the mutex and condition variable they used before
+///////////////////////////////////////////////////////////////////////////////
+struct WakeUpParking
+{
+  WakeUpParking(bool futexUsed, uint32 iterNum) :
+    iterNum(iterNum), word(0), acked(0), runTime(0.), futexUsed(futexUsed) {}
+  const uint32 iterNum;
+  volatile int32 word;  //!< Incremented by the waker
+  volatile int32 acked; //!< Last word seen by the sleeper
+  double runTime;       //!< When the sleeper woke up
+  bool futexUsed;       //!< Futex or mutex and condition variable
+  FutexSys futex;
+  MutexSys mutex;
+  ConditionSys cond;
+};
+
+static void wakeUpParkingRun(void *arg) {
+  WakeUpParking *parking = (WakeUpParking *) arg;
+  for (uint32 i = 0; i < parking->iterNum; ++i) {
+    if (parking->futexUsed)
+      while (parking->word == int32(i)) parking->futex.wait(&parking->word, int32(i));
+    else {
+      parking->mutex.lock();
+      while (parking->word == int32(i)) parking->cond.wait(parking->mutex);
+      parking->mutex.unlock();
+    }
+    parking->runTime = getSeconds();
+    __store_release(&parking->acked, int32(i + 1));
+  }
+}
+
+/*! Mean time to wake up a thread parked on the given primitive */
+static double wakeUpParkingLatency(bool futexUsed, uint32 iterNum) {
+  WakeUpParking parking(futexUsed, iterNum);
+  const thread_t thread = createThread(wakeUpParkingRun, &parking);
+  double latency = 0.;
+  for (uint32 i = 0; i < iterNum; ++i) {
+    yield(10);
+    const double t = getSeconds();
+    if (futexUsed) {
+      __store_release(&parking.word, int32(i + 1));
+      parking.futex.wakeUp(&parking.word);
+    } else {
+      parking.mutex.lock();
+      parking.word = int32(i + 1);
+      parking.cond.broadcast();
+      parking.mutex.unlock();
+    }
+    while (__load_acquire(&parking.acked) != int32(i + 1)) yield();
+    latency += parking.runTime - t;
+  }
+  join(thread);
+  return latency / double(iterNum);
+}
+
+class TaskWakeUp : public Task
+{
+public:
+  TaskWakeUp(double *runTime) : runTime(runTime) {}
+  virtual Task *run(void) {
+    *runTime = getSeconds();
+    return NULL;
+  }
+  double *runTime;
+};
+
+START_UTEST(TestWakeUpLatency)
+{
+  static const uint32 iterNum = 32;
+  const uint32 threadNum = TaskingSystemGetThreadNum();
+  if (threadNum > 1) {
+    double latency = 0.;
+    for (uint32 i = 0; i < iterNum; ++i) {
+      // Give enough time to the workers to go to sleep
+      yield(10);
+      double runTime = 0.;
+      Task *done = PF_NEW(TaskDone);
+      Task *wakeUp = PF_NEW(TaskWakeUp, &runTime);
+      wakeUp->setAffinity(1 + i % (threadNum - 1));
+      wakeUp->starts(done);
+      done->scheduled();
+      const double t = getSeconds();
+      wakeUp->scheduled();
+      TaskingSystemEnter();
+      latency += runTime - t;
+    }
+    std::cout << latency * 1e6 / double(iterNum) << " us" << std::endl;
+  }
+  std::cout << "parking alone: futex "
+            << wakeUpParkingLatency(true, iterNum) * 1e6 << " us, "
+            << "mutex and condition "
+            << wakeUpParkingLatency(false, iterNum) * 1e6 << " us" << std::endl;
+}
+END_UTEST(TestWakeUpLatency)
+
+///////////////////////////////////////////////////////////////////////////////
+// Check the bitmap used for the sleeping threads and the thieves. Finding the
+// next set bit (ie waking up a thread) should not depend on the bitmap size
+///////////////////////////////////////////////////////////////////////////////
+START_UTEST(TestBitmap)
+{
+  static const uint32 bitNums[] = {64, 256, 4096};
+  static const uint32 opNum = 1u << 20u;
+  Random rand;
+  for (uint32 i = 0; i < sizeof(bitNums) / sizeof(bitNums[0]); ++i) {
+    const uint32 bitNum = std::min(bitNums[i], uint32(Bitmap::maxBitNum));
+    Bitmap bitmap(bitNum);
+    bool *ref = PF_NEW_ARRAY(bool, bitNum);
+    for (uint32 j = 0; j < bitNum; ++j) ref[j] = false;
+
+    // Compare with a brute force implementation
+    for (uint32 j = 0; j < 4096; ++j) {
+      const uint32 bit = rand.getInt(bitNum);
+      if (ref[bit]) bitmap.clear(bit); else bitmap.set(bit);
+      ref[bit] = !ref[bit];
+      const uint32 from = rand.getInt(bitNum);
+      int32 expected = -1;
+      for (uint32 k = 0; k < bitNum; ++k)
+        if (ref[(from + k) % bitNum]) {
+          expected = int32((from + k) % bitNum);
+          break;
+        }
+      FATAL_IF (bitmap.findNext(from) != expected, "TestBitmap failed");
+    }
+    PF_DELETE_ARRAY(ref);
+
+    // Sparse bitmap as when a few threads are sleeping
+    for (uint32 j = 0; j < bitNum; ++j) if (bitmap.get(j)) bitmap.clear(j);
+    for (uint32 j = 0; j < 4; ++j) bitmap.set(rand.getInt(bitNum));
+    double t = getSeconds();
+    int64 sum = 0;
+    for (uint32 j = 0; j < opNum; ++j) {
+      const int32 bit = bitmap.findNext(j % bitNum);
+      bitmap.clear(bit);
+      bitmap.set((bit + 1 + j) % bitNum);
+      sum += bit;
+    }
+    t = getSeconds() - t;
+    std::cout << bitNum << " bits: " << t * 1e9 / double(opNum)
+              << " ns per find/clear/set (" << sum << ")" << std::endl;
+  }
+}
+END_UTEST(TestBitmap)
+
 ///////////////////////////////////////////////////////////////////////////////
 // Test tasking profiler
 ///////////////////////////////////////////////////////////////////////////////
@@ -652,14 +1998,20 @@ public:
   Atomic endNum;
 };
 
-START_UTEST(TestProfiler)
-{
-  UTestProfiler *profiler = PF_NEW(UTestProfiler);
+/*! The same tasks are profiled twice */
+static void TestProfilerRun(UTestProfiler *profiler) {
   TaskingSystemSetProfiler(profiler);
   TestFibo();
   TestTaskSet();
   TestMultiDependency();
   TestLockUnlock();
+  TaskingSystemSetProfiler(NULL);
+}
+
+START_UTEST(TestProfiler)
+{
+  UTestProfiler *profiler = PF_NEW(UTestProfiler);
+  TestProfilerRun(profiler);
 #define OUTPUT_FIELD(FIELD) \
   std::cout << #FIELD ": " << profiler->FIELD << std::endl
   OUTPUT_FIELD(sleepNum);
@@ -670,34 +2022,95 @@ START_UTEST(TestProfiler)
   OUTPUT_FIELD(runEndNum);
   OUTPUT_FIELD(endNum);    
 #undef OUTPUT_FIELD
-  TaskingSystemSetProfiler(NULL);
   PF_DELETE(profiler);
+
+  // Baseline: the producers wake up a thread even if others look for tasks
+  UTestProfiler *baseline = PF_NEW(UTestProfiler);
+  TaskingSystemSetWakeUpAlways(true);
+  TestProfilerRun(baseline);
+  TaskingSystemSetWakeUpAlways(false);
+  std::cout << "wakeUpNum when waking up at each push: "
+            << baseline->wakeUpNum << std::endl;
+  PF_DELETE(baseline);
 }
 END_UTEST(TestProfiler)
 #endif /* PF_TASK_PROFILER */
 
 /*! Run all tasking tests */
+///////////////////////////////////////////////////////////////////////////////
+// Without argument, all the tests run forever. Otherwise, the named tests
+// (without the "Test" prefix) run once
+///////////////////////////////////////////////////////////////////////////////
+static void TestTreeNodeOpt(void) { TestTree<TaskNodeOpt>(); }
+static void TestTreeNode(void) { TestTree<TaskNode>(); }
+static void TestTreeCascadeNodeOpt(void) { TestTree<TaskCascadeNodeOpt>(); }
+static void TestTreeCascadeNode(void) { TestTree<TaskCascadeNode>(); }
+
+static const struct { const char *name; void (*run)(void); } namedTests[] = {
+  {"Dummy", TestDummy},
+  {"TreeNodeOpt", TestTreeNodeOpt},
+  {"TreeNode", TestTreeNode},
+  {"TreeCascadeNodeOpt", TestTreeCascadeNodeOpt},
+  {"TreeCascadeNode", TestTreeCascadeNode},
+  {"TaskSet", TestTaskSet},
+  {"ParallelFor", TestParallelFor},
+  {"Allocator", TestAllocator},
+  {"AllocatorRemote", TestAllocatorRemote},
+  {"Reclaim", TestReclaim},
+  {"BigTask", TestBigTask},
+  {"Spawn", TestSpawn},
+  {"SizeClass", TestSizeClass},
+  {"ChunkLayout", TestChunkLayout},
+  {"Numa", TestNuma},
+  {"FullQueue", TestFullQueue},
+  {"StealHalf", TestStealHalf},
+  {"WaitAll", TestWaitAll},
+  {"Affinity", TestAffinity},
+  {"Foreign", TestForeign},
+  {"ForeignEvent", TestForeignEvent},
+  {"Fibo", TestFibo},
+  {"FiboWait", TestFiboWait},
+  {"WaitNested", TestWaitNested},
+#if PF_TASK_COROUTINE
+  {"FiboCoroutine", TestFiboCoroutine},
+#endif /* PF_TASK_COROUTINE */
+  {"Fiber", TestFiber},
+  {"FiberWait", TestFiberWait},
+#if defined(__LINUX__)
+  {"FiberGuard", TestFiberGuard},
+#endif /* defined(__LINUX__) */
+  {"RunSomething", TestRunSomething},
+  {"Timer", TestTimer},
+#if PF_TASK_IO
+  {"IO", TestIO},
+#endif /* PF_TASK_IO */
+  {"MultiDependency", TestMultiDependency},
+  {"MultiDependencyTwoStage", TestMultiDependencyTwoStage},
+  {"MultiDependencyRandomStart", TestMultiDependencyRandomStart},
+  {"LockUnlock", TestLockUnlock},
+  {"WakeUpLatency", TestWakeUpLatency},
+  {"Bitmap", TestBitmap},
+  {"Profiler", TestProfiler},
+};
+
 int main(int argc, char *argv[])
 {
   MemDebuggerStart();
   TaskingSystemStart();
-  for (;;) {
-    TestDummy();
-    TestTree<TaskNodeOpt>();
-    TestTree<TaskNode>();
-    TestTree<TaskCascadeNodeOpt>();
-    TestTree<TaskCascadeNode>();
-    TestTaskSet();
-    TestAllocator();
-    TestFullQueue();
-    TestAffinity();
-    TestFibo();
-    TestMultiDependency();
-    TestMultiDependencyTwoStage();
-    TestMultiDependencyRandomStart();
-    TestLockUnlock();
-    TestProfiler();
+  const size_t testNum = sizeof(namedTests) / sizeof(namedTests[0]);
+  if (argc > 1) {
+    for (int i = 1; i < argc; ++i) {
+      size_t j = 0;
+      while (j < testNum && strcmp(namedTests[j].name, argv[i]) != 0) ++j;
+      FATAL_IF (j == testNum, std::string("unknown test ") + argv[i]);
+      namedTests[j].run();
+    }
+    TaskingSystemEnd();
+    MemDebuggerEnd();
+    return 0;
   }
+  for (;;)
+    for (size_t i = 0; i < testNum; ++i) namedTests[i].run();
   TaskingSystemEnd();
   MemDebuggerEnd();
   return 0;